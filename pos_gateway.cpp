@@ -1,8 +1,10 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <sstream>
 #include <iomanip>
@@ -13,645 +15,7348 @@
 #include <thread>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <queue>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <csignal>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <future>
+#include <functional>
+#include <fstream>
+#include <charconv>
+#include <cstdint>
+#include <type_traits>
+#include <cmath>
+#include <array>
+#include <cstddef>
+#include <limits>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
-class TransactionDB {
+#ifndef POSGW_MAX_LOG_LEVEL
+#define POSGW_MAX_LOG_LEVEL 3
+#endif
+
+enum class LogLevel : int {
+    Error = 0,
+    Warn = 1,
+    Info = 2,
+    Debug = 3
+};
+
+bool parseLogLevel(const std::string& value, LogLevel& level) {
+    if (value == "error") {
+        level = LogLevel::Error;
+    } else if (value == "warn") {
+        level = LogLevel::Warn;
+    } else if (value == "info") {
+        level = LogLevel::Info;
+    } else if (value == "debug") {
+        level = LogLevel::Debug;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Log calls only capture the format pointer and the raw arguments into a
+// fixed-size record; the text is produced later by the drain thread. A
+// string cut to fit the record, or an argument left out for lack of room,
+// is rendered with a trailing "..." so a clipped message is recognisable.
+class Logger {
 private:
-    sqlite3* db;
+    enum ArgType : uint8_t {
+        kInt,
+        kUInt,
+        kDouble,
+        kString,
+        kCutString,
+        kChar
+    };
 
-public:
-    TransactionDB() : db(nullptr) {}
+    static constexpr size_t kRecordSize = 256;
+    static constexpr size_t kRingSize = 1024;
 
-    ~TransactionDB() {
-        if (db) {
-            sqlite3_close(db);
+    struct Record {
+        const char* format;
+        LogLevel level;
+        uint8_t arg_count;
+        // Set when an argument did not fit at all.
+        bool truncated;
+        uint16_t payload_size;
+        char payload[kRecordSize - sizeof(const char*) - 8];
+    };
+    static_assert(sizeof(Record) == kRecordSize, "log records must stay one fixed size");
+
+    struct Ring {
+        Record records[kRingSize];
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    class Encoder {
+    private:
+        Record& record;
+
+    public:
+        explicit Encoder(Record& record) : record(record) {}
+
+        void add(ArgType type, const void* data, size_t size) {
+            size_t room = sizeof(record.payload) - record.payload_size;
+            if (room < 1 + size) {
+                record.truncated = true;
+                return;
+            }
+            record.payload[record.payload_size++] = static_cast<char>(type);
+            memcpy(record.payload + record.payload_size, data, size);
+            record.payload_size += size;
+            record.arg_count++;
         }
-    }
 
-    bool init(const std::string& db_path = "transactions.db") {
-        int rc = sqlite3_open(db_path.c_str(), &db);
-        if (rc) {
-            std::cerr << "Can't open database: " << sqlite3_errmsg(db) << std::endl;
-            return false;
+        void addString(std::string_view text) {
+            size_t room = sizeof(record.payload) - record.payload_size;
+            if (room < 2) {
+                record.truncated = true;
+                return;
+            }
+            size_t len = std::min({text.size(), room - 2, size_t(255)});
+            record.payload[record.payload_size++] = static_cast<char>(len < text.size() ? kCutString : kString);
+            record.payload[record.payload_size++] = static_cast<char>(len);
+            memcpy(record.payload + record.payload_size, text.data(), len);
+            record.payload_size += len;
+            record.arg_count++;
         }
 
-        const char* sql = R"(
-            CREATE TABLE IF NOT EXISTS transactions (
-                id INTEGER PRIMARY KEY AUTOINCREMENT,
-                amount REAL NOT NULL,
-                approved BOOLEAN NOT NULL,
-                auth_code TEXT,
-                masked_pan TEXT,
-                rrn TEXT,
-                unix_ts INTEGER,
-                nonce TEXT
-            );
-        )";
+        void encode(bool value) {
+            addString(value ? "true" : "false");
+        }
 
-        rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Can't create table: " << sqlite3_errmsg(db) << std::endl;
-            return false;
+        void encode(char value) {
+            add(kChar, &value, 1);
         }
 
-        std::cout << "Database initialized successfully" << std::endl;
-        return true;
+        void encode(const char* value) {
+            addString(value ? value : "");
+        }
+
+        void encode(const std::string& value) {
+            addString(value);
+        }
+
+        void encode(std::string_view value) {
+            addString(value);
+        }
+
+        template <typename T>
+        std::enable_if_t<std::is_integral<T>::value && std::is_signed<T>::value> encode(T value) {
+            int64_t v = value;
+            add(kInt, &v, sizeof(v));
+        }
+
+        template <typename T>
+        std::enable_if_t<std::is_integral<T>::value && !std::is_signed<T>::value> encode(T value) {
+            uint64_t v = value;
+            add(kUInt, &v, sizeof(v));
+        }
+
+        template <typename T>
+        std::enable_if_t<std::is_floating_point<T>::value> encode(T value) {
+            double v = value;
+            add(kDouble, &v, sizeof(v));
+        }
+    };
+
+    std::atomic<int> level;
+    std::atomic<bool> async;
+    std::atomic<bool> running;
+    std::mutex rings_mutex;
+    std::vector<std::unique_ptr<Ring>> rings;
+    // Rings of exited threads, handed to the next thread that logs. They
+    // stay in rings, so records left in them are still drained.
+    std::vector<Ring*> free_rings;
+    std::mutex drain_mutex;
+    std::mutex sync_mutex;
+    std::thread drain_thread;
+    std::string out_buffer;
+    std::string err_buffer;
+
+    Logger() : level(static_cast<int>(LogLevel::Info)), async(false), running(false) {}
+
+public:
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
     }
 
-    bool insertTransaction(double amount, bool approved, const std::string& auth_code = "", 
-                          const std::string& masked_pan = "", const std::string& rrn = "",
-                          long unix_ts = 0, const std::string& nonce = "") {
-        const char* sql = "INSERT INTO transactions (amount, approved, auth_code, masked_pan, rrn, unix_ts, nonce) VALUES (?, ?, ?, ?, ?, ?, ?);";
-        sqlite3_stmt* stmt;
+    ~Logger() {
+        stopAsync();
+    }
 
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-            return false;
+    static bool enabled(LogLevel lvl) {
+        return static_cast<int>(lvl) <= instance().level.load(std::memory_order_relaxed);
+    }
+
+    void setLevel(LogLevel lvl) {
+        level.store(static_cast<int>(lvl), std::memory_order_relaxed);
+    }
+
+    // Until this is called, log calls format and write on the caller's
+    // thread, which keeps CLI output ordered with std::cout.
+    void startAsync() {
+        if (running.exchange(true)) {
+            return;
         }
+        drain_thread = std::thread([this] { drainLoop(); });
+        async.store(true, std::memory_order_release);
+    }
 
-        sqlite3_bind_double(stmt, 1, amount);
-        sqlite3_bind_int(stmt, 2, approved ? 1 : 0);
-        sqlite3_bind_text(stmt, 3, auth_code.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 4, masked_pan.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(stmt, 5, rrn.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int64(stmt, 6, unix_ts);
-        sqlite3_bind_text(stmt, 7, nonce.c_str(), -1, SQLITE_STATIC);
+    void stopAsync() {
+        if (!running.exchange(false)) {
+            return;
+        }
+        drain_thread.join();
+        async.store(false, std::memory_order_release);
+        drain();
+    }
 
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
+    template <size_t N, typename... Args>
+    void log(LogLevel lvl, const char (&format)[N], const Args&... args) {
+        if (!async.load(std::memory_order_acquire)) {
+            Record record;
+            fillRecord(record, lvl, format, args...);
+            std::lock_guard<std::mutex> lock(sync_mutex);
+            std::string text;
+            formatRecord(record, text);
+            writeAll(lvl <= LogLevel::Warn ? STDERR_FILENO : STDOUT_FILENO, text);
+            return;
+        }
 
-        if (rc != SQLITE_DONE) {
-            std::cerr << "Failed to insert transaction: " << sqlite3_errmsg(db) << std::endl;
-            return false;
+        Ring& ring = threadRing();
+        size_t tail = ring.tail.load(std::memory_order_relaxed);
+        if (tail - ring.head.load(std::memory_order_acquire) == kRingSize) {
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
         }
+        fillRecord(ring.records[tail % kRingSize], lvl, format, args...);
+        ring.tail.store(tail + 1, std::memory_order_release);
+    }
 
-        std::cout << "Transaction stored: Amount=$" << std::fixed << std::setprecision(2) 
-                  << amount << ", Approved=" << (approved ? "true" : "false") << std::endl;
-        return true;
+private:
+    template <typename... Args>
+    static void fillRecord(Record& record, LogLevel lvl, const char* format, const Args&... args) {
+        record.format = format;
+        record.level = lvl;
+        record.arg_count = 0;
+        record.truncated = false;
+        record.payload_size = 0;
+        Encoder encoder(record);
+        (encoder.encode(args), ...);
     }
 
-    bool getLastTransactions(int n) {
-        const char* sql = R"(
-            SELECT id, amount, approved, auth_code, masked_pan, rrn, unix_ts, nonce 
-            FROM transactions 
-            ORDER BY id DESC 
-            LIMIT ?;
-        )";
-        
-        sqlite3_stmt* stmt;
-        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr);
-        if (rc != SQLITE_OK) {
-            std::cerr << "Failed to prepare statement: " << sqlite3_errmsg(db) << std::endl;
-            return false;
-        }
-
-        sqlite3_bind_int(stmt, 1, n);
-
-        std::cout << "\nLast " << n << " transactions:" << std::endl;
-        std::cout << std::string(80, '=') << std::endl;
-        std::cout << std::left << std::setw(4) << "ID" 
-                  << std::setw(10) << "Amount" 
-                  << std::setw(10) << "Status"
-                  << std::setw(8) << "Auth"
-                  << std::setw(18) << "Masked PAN"
-                  << std::setw(14) << "RRN"
-                  << std::setw(12) << "Timestamp"
-                  << "Nonce" << std::endl;
-        std::cout << std::string(80, '-') << std::endl;
-
-        int count = 0;
-        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
-            int id = sqlite3_column_int(stmt, 0);
-            double amount = sqlite3_column_double(stmt, 1);
-            bool approved = sqlite3_column_int(stmt, 2) != 0;
-            const char* auth_code = (const char*)sqlite3_column_text(stmt, 3);
-            const char* masked_pan = (const char*)sqlite3_column_text(stmt, 4);
-            const char* rrn = (const char*)sqlite3_column_text(stmt, 5);
-            long unix_ts = sqlite3_column_int64(stmt, 6);
-            const char* nonce = (const char*)sqlite3_column_text(stmt, 7);
-
-            std::cout << std::left << std::setw(4) << id 
-                      << "$" << std::setw(8) << std::fixed << std::setprecision(2) << amount
-                      << std::setw(10) << (approved ? "APPROVED" : "DECLINED")
-                      << std::setw(8) << (auth_code ? auth_code : "")
-                      << std::setw(18) << (masked_pan ? masked_pan : "")
-                      << std::setw(14) << (rrn ? rrn : "")
-                      << std::setw(12) << unix_ts
-                      << (nonce ? nonce : "") << std::endl;
-            count++;
+    // Returns the thread's ring to the free list when the thread exits, so
+    // short-lived threads do not each leave a ring behind.
+    struct RingLease {
+        Ring* ring = nullptr;
+
+        ~RingLease() {
+            if (ring) {
+                Logger& logger = instance();
+                std::lock_guard<std::mutex> lock(logger.rings_mutex);
+                logger.free_rings.push_back(ring);
+            }
         }
+    };
 
-        sqlite3_finalize(stmt);
+    Ring& threadRing() {
+        thread_local RingLease lease;
+        if (!lease.ring) {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            if (!free_rings.empty()) {
+                lease.ring = free_rings.back();
+                free_rings.pop_back();
+            } else {
+                rings.push_back(std::make_unique<Ring>());
+                lease.ring = rings.back().get();
+            }
+        }
+        return *lease.ring;
+    }
 
-        if (rc != SQLITE_DONE) {
-            std::cerr << "Error reading transactions: " << sqlite3_errmsg(db) << std::endl;
-            return false;
+    void drainLoop() {
+        int idle_ms = 1;
+        while (running.load(std::memory_order_relaxed)) {
+            if (drain()) {
+                idle_ms = 1;
+            } else {
+                idle_ms = std::min(idle_ms * 2, 50);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(idle_ms));
         }
+    }
 
-        if (count == 0) {
-            std::cout << "No transactions found in database." << std::endl;
-        } else {
-            std::cout << std::string(80, '=') << std::endl;
-            std::cout << "Total: " << count << " transaction(s) displayed" << std::endl;
+    bool drain() {
+        std::lock_guard<std::mutex> drain_lock(drain_mutex);
+        std::vector<Ring*> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(rings_mutex);
+            for (auto& ring : rings) {
+                snapshot.push_back(ring.get());
+            }
         }
 
-        return true;
+        bool any = false;
+        for (Ring* ring : snapshot) {
+            size_t head = ring->head.load(std::memory_order_relaxed);
+            size_t tail = ring->tail.load(std::memory_order_acquire);
+            for (; head != tail; head++) {
+                const Record& record = ring->records[head % kRingSize];
+                formatRecord(record, record.level <= LogLevel::Warn ? err_buffer : out_buffer);
+            }
+            ring->head.store(head, std::memory_order_release);
+
+            uint64_t dropped = ring->dropped.exchange(0, std::memory_order_relaxed);
+            if (dropped > 0) {
+                err_buffer += "Logger dropped " + std::to_string(dropped) + " message(s)\n";
+            }
+        }
+
+        any = !out_buffer.empty() || !err_buffer.empty();
+        writeAll(STDOUT_FILENO, out_buffer);
+        writeAll(STDERR_FILENO, err_buffer);
+        out_buffer.clear();
+        err_buffer.clear();
+        return any;
     }
-};
 
-std::string generateNonce() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 15);
-    
-    std::string nonce;
-    int length = 8 + (gen() % 9);
-    
-    for (int i = 0; i < length; i++) {
-        int val = dis(gen);
-        nonce += (val < 10) ? ('0' + val) : ('A' + val - 10);
+    static void formatRecord(const Record& record, std::string& out) {
+        const char* payload = record.payload;
+        const char* payload_end = record.payload + record.payload_size;
+
+        for (const char* p = record.format; *p; p++) {
+            if (p[0] != '{') {
+                out.push_back(*p);
+                continue;
+            }
+            const char* close_brace = strchr(p, '}');
+            if (!close_brace) {
+                out.append(p);
+                break;
+            }
+
+            int precision = -1;
+            if (p[1] == ':' && p[2] == '.') {
+                precision = atoi(p + 3);
+            }
+            p = close_brace;
+
+            if (payload >= payload_end) {
+                if (record.truncated) {
+                    out.append("...");
+                }
+                continue;
+            }
+
+            ArgType type = static_cast<ArgType>(*payload++);
+            char number[64];
+            switch (type) {
+                case kInt: {
+                    int64_t v;
+                    memcpy(&v, payload, sizeof(v));
+                    payload += sizeof(v);
+                    out.append(number, std::to_chars(number, number + sizeof(number), v).ptr);
+                    break;
+                }
+                case kUInt: {
+                    uint64_t v;
+                    memcpy(&v, payload, sizeof(v));
+                    payload += sizeof(v);
+                    out.append(number, std::to_chars(number, number + sizeof(number), v).ptr);
+                    break;
+                }
+                case kDouble: {
+                    double v;
+                    memcpy(&v, payload, sizeof(v));
+                    payload += sizeof(v);
+                    int len = precision >= 0 ? snprintf(number, sizeof(number), "%.*f", precision, v)
+                                             : snprintf(number, sizeof(number), "%g", v);
+                    out.append(number, std::min<size_t>(len, sizeof(number) - 1));
+                    break;
+                }
+                case kChar:
+                    out.push_back(*payload++);
+                    break;
+                case kString:
+                case kCutString: {
+                    size_t len = static_cast<uint8_t>(*payload++);
+                    out.append(payload, len);
+                    payload += len;
+                    if (type == kCutString) {
+                        out.append("...");
+                    }
+                    break;
+                }
+            }
+        }
+        out.push_back('\n');
     }
-    
-    return nonce;
-}
 
-std::string generateAuthCode() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(100000, 999999);
-    return std::to_string(dis(gen));
-}
+    static void writeAll(int fd, const std::string& text) {
+        size_t written = 0;
+        while (written < text.size()) {
+            ssize_t n = write(fd, text.data() + written, text.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            written += n;
+        }
+    }
+};
 
-std::string generateMaskedPAN() {
-    return "****-****-****-1234";
+#define POSGW_LOG(lvl, ...)                                             \
+    do {                                                                \
+        if constexpr (static_cast<int>(lvl) <= POSGW_MAX_LOG_LEVEL) {   \
+            if (Logger::enabled(lvl)) {                                 \
+                Logger::instance().log(lvl, __VA_ARGS__);               \
+            }                                                           \
+        }                                                               \
+    } while (0)
+
+#define LOG_ERROR(...) POSGW_LOG(LogLevel::Error, __VA_ARGS__)
+#define LOG_WARN(...) POSGW_LOG(LogLevel::Warn, __VA_ARGS__)
+#define LOG_INFO(...) POSGW_LOG(LogLevel::Info, __VA_ARGS__)
+#define LOG_DEBUG(...) POSGW_LOG(LogLevel::Debug, __VA_ARGS__)
+
+template <size_t N>
+void copyField(char (&dst)[N], std::string_view src) {
+    size_t len = std::min(src.size(), N - 1);
+    memcpy(dst, src.data(), len);
+    dst[len] = '\0';
 }
 
-std::string generateRRN() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<long long> dis(100000000000LL, 999999999999LL);
-    return std::to_string(dis(gen));
+inline bool isDigit(char c) {
+    return c >= '0' && c <= '9';
 }
 
-long getCurrentUnixTimestamp() {
-    return std::chrono::duration_cast<std::chrono::seconds>(
-        std::chrono::system_clock::now().time_since_epoch()).count();
+inline bool isHexDigit(char c) {
+    return isDigit(c) || (c >= 'A' && c <= 'F') || (c >= 'a' && c <= 'f');
 }
 
-bool setSocketTimeout(int socket, int timeout_ms) {
-    struct timeval tv;
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    
-    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+// Parses "<units>[.<d>[<d>]]" into minor units (cents).
+bool parseAmountMinor(std::string_view text, int64_t& minor) {
+    size_t dot = text.find('.');
+    std::string_view units = text.substr(0, dot);
+    std::string_view fraction = dot == std::string_view::npos ? std::string_view() : text.substr(dot + 1);
+
+    if (units.empty() && fraction.empty()) {
         return false;
     }
-    if (setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+    if (fraction.size() > 2) {
+        return false;
+    }
+
+    int64_t whole = 0;
+    if (!units.empty()) {
+        if (!isDigit(units.front())) {
+            return false;
+        }
+        auto result = std::from_chars(units.data(), units.data() + units.size(), whole);
+        if (result.ec != std::errc() || result.ptr != units.data() + units.size()) {
+            return false;
+        }
+    }
+    if (whole > INT64_MAX / 100 - 1) {
         return false;
     }
+
+    int64_t cents = 0;
+    for (size_t i = 0; i < 2; i++) {
+        cents *= 10;
+        if (i < fraction.size()) {
+            if (!isDigit(fraction[i])) {
+                return false;
+            }
+            cents += fraction[i] - '0';
+        }
+    }
+
+    minor = whole * 100 + cents;
     return true;
 }
 
-std::string stripCR(const std::string& str) {
-    std::string result = str;
-    if (!result.empty() && result.back() == '\r') {
-        result.pop_back();
+std::string formatMinorUnits(int64_t minor) {
+    char buffer[32];
+    char* end = buffer;
+    uint64_t magnitude = static_cast<uint64_t>(minor);
+    if (minor < 0) {
+        *end++ = '-';
+        magnitude = 0 - magnitude;
     }
-    return result;
+    uint64_t whole = magnitude / 100;
+    int cents = static_cast<int>(magnitude % 100);
+    end = std::to_chars(end, buffer + sizeof(buffer) - 3, whole).ptr;
+    *end++ = '.';
+    *end++ = static_cast<char>('0' + cents / 10);
+    *end++ = static_cast<char>('0' + cents % 10);
+    return std::string(buffer, end);
 }
 
-class PaymentGatewayServer {
-private:
-    int server_socket;
-    int port;
-    TransactionDB db;
-
-public:
-    PaymentGatewayServer(int port) : port(port), server_socket(-1) {}
+// Fixed-point amount: integer minor units (cents) plus an ISO 4217
+// currency code. All arithmetic and comparisons are exact.
+struct Money {
+    int64_t minor;
+    char currency[4];
 
-    ~PaymentGatewayServer() {
-        if (server_socket != -1) {
-            close(server_socket);
-        }
+    static Money fromMinor(int64_t minor, std::string_view currency = "USD") {
+        Money money{};
+        money.minor = minor;
+        copyField(money.currency, currency);
+        return money;
     }
 
-    bool start() {
-        if (!db.init()) {
-            std::cerr << "Failed to initialize database" << std::endl;
-            return false;
-        }     
-        server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket == -1) {
-            std::cerr << "Failed to create socket" << std::endl;
+    // Accepts "<units>[.<d>[<d>]]"; see parseAmountMinor.
+    static bool parse(std::string_view text, Money& money, std::string_view currency = "USD") {
+        int64_t minor;
+        if (!parseAmountMinor(text, minor)) {
             return false;
         }
+        money = fromMinor(minor, currency);
+        return true;
+    }
 
-        int opt = 1;
-        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-            std::cerr << "Failed to set socket options" << std::endl;
-            return false;
-        }
+    std::string_view currencyCode() const {
+        return std::string_view(currency);
+    }
 
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = htons(port);
+    std::string toString() const {
+        return formatMinorUnits(minor);
+    }
 
-        if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            std::cerr << "Bind failed on port " << port << ": " << strerror(errno) << std::endl;
-            std::cerr << "Port may already be in use. Try a different port or wait a moment." << std::endl;
-            return false;
-        }
+    bool operator==(const Money& other) const {
+        return minor == other.minor && currencyCode() == other.currencyCode();
+    }
 
-        if (listen(server_socket, 5) < 0) {
-            std::cerr << "Listen failed" << std::endl;
-            return false;
-        }
+    // Orders by currency first: amounts in different currencies are never
+    // compared by their minor units alone.
+    bool operator<(const Money& other) const {
+        int order = currencyCode().compare(other.currencyCode());
+        return order != 0 ? order < 0 : minor < other.minor;
+    }
+};
 
-        std::cout << "Payment Gateway Terminal listening on port " << port << std::endl;
-        return true;
+struct TransactionRecord {
+    Money amount;
+    bool approved;
+    long unix_ts;
+    char auth_code[8];
+    char masked_pan[24];
+    char rrn[16];
+    char nonce[20];
+};
+
+struct StoredTransaction {
+    int64_t id;
+    Money amount;
+    bool approved;
+    std::string auth_code;
+    std::string masked_pan;
+    std::string rrn;
+    long unix_ts;
+    std::string nonce;
+};
+
+// Decodes a row selected as id, amount_minor, approved, auth_code,
+// masked_pan, rrn, unix_ts, nonce, currency.
+void readStoredTransaction(sqlite3_stmt* stmt, StoredTransaction& row) {
+    auto text = [&](int column) {
+        const char* value = (const char*)sqlite3_column_text(stmt, column);
+        return std::string(value ? value : "");
+    };
+    row.id = sqlite3_column_int64(stmt, 0);
+    row.amount = Money::fromMinor(sqlite3_column_int64(stmt, 1), text(8));
+    row.approved = sqlite3_column_int(stmt, 2) != 0;
+    row.auth_code = text(3);
+    row.masked_pan = text(4);
+    row.rrn = text(5);
+    row.unix_ts = sqlite3_column_int64(stmt, 6);
+    row.nonce = text(7);
+}
+
+// Filters and page position for TransactionDB::openQuery. Rows come newest
+// first by (unix_ts, id), or oldest first when ascending; with a cursor
+// the page starts right after the row it names, so every page is an index
+// seek rather than an OFFSET scan.
+struct TransactionQuery {
+    int64_t from_ts = std::numeric_limits<int64_t>::min();  // inclusive
+    int64_t to_ts = std::numeric_limits<int64_t>::max();    // exclusive
+    int approved = -1;                                      // -1 for either
+    std::string rrn;
+    std::string auth_code;
+    bool ascending = false;
+    bool has_cursor = false;
+    int64_t cursor_ts = 0;
+    int64_t cursor_id = 0;
+    int64_t limit = -1;                                     // -1 for no limit
+    // Orders by id alone, as last --n does for a single file; cursor_ts is
+    // then unused.
+    bool by_id = false;
+};
+
+// Cursors are written as "<unix_ts>:<id>" of the last row of a page.
+bool parseQueryCursor(std::string_view text, TransactionQuery& query) {
+    size_t colon = text.find(':');
+    if (colon == std::string_view::npos) {
+        return false;
+    }
+    auto ts = std::from_chars(text.data(), text.data() + colon, query.cursor_ts);
+    auto id = std::from_chars(text.data() + colon + 1, text.data() + text.size(), query.cursor_id);
+    if (ts.ec != std::errc() || ts.ptr != text.data() + colon || id.ec != std::errc() ||
+        id.ptr != text.data() + text.size()) {
+        return false;
     }
+    query.has_cursor = true;
+    return true;
+}
 
-    void run() {
-        while (true) {
-            sockaddr_in client_addr{};
-            socklen_t client_len = sizeof(client_addr);
-            
-            int client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &client_len);
-            if (client_socket < 0) {
-                std::cerr << "Accept failed" << std::endl;
-                continue;
-            }
+// The rows of one TransactionDB::openQuery, stepped out of SQLite one at
+// a time.
+class TransactionCursor {
+    friend class TransactionDB;
 
-            setSocketTimeout(client_socket, 3000); 
+    sqlite3* db = nullptr;
+    sqlite3_stmt* stmt = nullptr;
+    bool error = false;
 
-            handleClient(client_socket);
+public:
+    TransactionCursor() = default;
+    TransactionCursor(const TransactionCursor&) = delete;
+    TransactionCursor& operator=(const TransactionCursor&) = delete;
+
+    ~TransactionCursor() {
+        if (stmt) {
+            sqlite3_finalize(stmt);
         }
     }
 
-private:
-    std::string readLine(int socket) {
-        std::string line;
-        char c;
-        while (recv(socket, &c, 1, 0) == 1) {
-            if (c == '\n') {
-                break;
-            }
-            if (c != '\r') { 
-                line += c;
-            }
+    // False at the end of the result or on an error; see failed().
+    bool next(StoredTransaction& row) {
+        if (!stmt) {
+            return false;
         }
-        return line;
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            readStoredTransaction(stmt, row);
+            return true;
+        }
+        if (rc != SQLITE_DONE) {
+            LOG_ERROR("Error reading transactions: {}", sqlite3_errmsg(db));
+            error = true;
+        }
+        sqlite3_finalize(stmt);
+        stmt = nullptr;
+        return false;
     }
 
-    bool sendLine(int socket, const std::string& line) {
-        std::string message = line + "\n";
-        return send(socket, message.c_str(), message.length(), 0) >= 0;
+    bool failed() const {
+        return error;
     }
+};
 
-    void handleClient(int client_socket) {
-        std::cout << "Client connected, waiting for handshake..." << std::endl;
-
-        try {
-            std::string hello_msg = readLine(client_socket);
-            hello_msg = stripCR(hello_msg);
-            std::cout << "Received: " << hello_msg << std::endl;
-
-            if (hello_msg != "HELLO|GW|1.0") {
-                std::cerr << "Invalid handshake received: " << hello_msg << std::endl;
-                close(client_socket);
-                return;
-            }
+// Sharded storage gives worker i its own file; transaction ids there are
+// seq * kShardIdStride + i, so they stay unique across shards.
+constexpr int64_t kShardIdStride = 1024;
 
-            if (!sendLine(client_socket, "HELLO|TERM|1.0")) {
-                std::cerr << "Failed to send terminal hello" << std::endl;
-                close(client_socket);
-                return;
-            }
+// PRAGMA user_version of a database whose table has the current layout.
+constexpr int kSchemaVersion = 2;
 
-            std::cout << "Handshake completed, waiting for AUTH..." << std::endl;
+std::string shardDatabasePath(int shard) {
+    return "transactions.shard" + std::to_string(shard) + ".db";
+}
 
-            while (true) {
-                std::string request = readLine(client_socket);
-                request = stripCR(request);
-                
-                if (request.empty()) {
-                    break;
-                }
+class TransactionDB {
+private:
+    sqlite3* db;
+    sqlite3_stmt* insert_stmt;
+    sqlite3_stmt* replay_stmt;
+    std::mutex mutex;
+    int shard;
+    int64_t next_seq;
 
-                std::cout << "Received: " << request << std::endl;
+public:
+    TransactionDB() : db(nullptr), insert_stmt(nullptr), replay_stmt(nullptr), shard(-1), next_seq(0) {}
 
-                if (request == "PING") {
-                    if (!sendLine(client_socket, "PONG")) {
-                        std::cerr << "Failed to send PONG" << std::endl;
-                        break;
+    ~TransactionDB() {
+        if (insert_stmt) {
+            sqlite3_finalize(insert_stmt);
+        }
+        if (replay_stmt) {
+            sqlite3_finalize(replay_stmt);
+        }
+        if (db) {
+            sqlite3_close(db);
+        }
+    }
+
+    // shard >= 0 assigns ids explicitly from that shard's id sequence;
+    // otherwise SQLite's AUTOINCREMENT picks them.
+    bool init(const std::string& db_path = "transactions.db", int shard_index = -1) {
+        shard = shard_index;
+        int rc = sqlite3_open(db_path.c_str(), &db);
+        if (rc) {
+            LOG_ERROR("Can't open database: {}", sqlite3_errmsg(db));
+            return false;
+        }
+
+        rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=FULL;", nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Can't enable WAL mode: {}", sqlite3_errmsg(db));
+            return false;
+        }
+
+        const char* sql = R"(
+            CREATE TABLE IF NOT EXISTS transactions (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                amount_minor INTEGER NOT NULL,
+                currency TEXT NOT NULL DEFAULT 'USD',
+                approved BOOLEAN NOT NULL,
+                auth_code TEXT,
+                masked_pan TEXT,
+                rrn TEXT,
+                unix_ts INTEGER NOT NULL DEFAULT 0,
+                nonce TEXT
+            );
+        )";
+
+        if (!migrate()) {
+            return false;
+        }
+
+        rc = sqlite3_exec(db, sql, nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Can't create table: {}", sqlite3_errmsg(db));
+            return false;
+        }
+        std::string version_sql = "PRAGMA user_version = " + std::to_string(kSchemaVersion) + ";";
+        rc = sqlite3_exec(db, version_sql.c_str(), nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Can't set the schema version: {}", sqlite3_errmsg(db));
+            return false;
+        }
+
+        // (unix_ts, id) serves time ranges and keyset pages in either
+        // direction; the status index carries the same suffix so a status
+        // filter keeps that order without a sort.
+        const char* index_sql = R"(
+            CREATE INDEX IF NOT EXISTS transactions_ts ON transactions (unix_ts, id);
+            CREATE INDEX IF NOT EXISTS transactions_approved ON transactions (approved, unix_ts, id);
+            CREATE INDEX IF NOT EXISTS transactions_rrn ON transactions (rrn);
+            CREATE INDEX IF NOT EXISTS transactions_auth_code ON transactions (auth_code);
+        )";
+        rc = sqlite3_exec(db, index_sql, nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Can't create indexes: {}", sqlite3_errmsg(db));
+            return false;
+        }
+
+        if (shard >= 0 && !loadNextSeq()) {
+            return false;
+        }
+
+        const char* insert_sql = "INSERT INTO transactions (amount_minor, currency, approved, auth_code, masked_pan, rrn, unix_ts, nonce, id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
+        rc = sqlite3_prepare_v2(db, insert_sql, -1, &insert_stmt, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare statement: {}", sqlite3_errmsg(db));
+            return false;
+        }
+        const char* replay_sql = "INSERT OR IGNORE INTO transactions (amount_minor, currency, approved, auth_code, masked_pan, rrn, unix_ts, nonce, id) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);";
+        rc = sqlite3_prepare_v2(db, replay_sql, -1, &replay_stmt, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare statement: {}", sqlite3_errmsg(db));
+            return false;
+        }
+
+        LOG_INFO("Database initialized successfully");
+        return true;
+    }
+
+    // Opens an existing database for openQuery() only: nothing is created,
+    // migrated or indexed, so readers never take write locks against a
+    // running server. A file the server has not brought up to the current
+    // schema yet is refused.
+    bool openReadOnly(const std::string& db_path) {
+        int rc = sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr);
+        if (rc != SQLITE_OK) {
+            LOG_ERROR("Can't open database {}: {}", db_path, sqlite3_errmsg(db));
+            return false;
+        }
+        int version = schemaVersion();
+        if (version < 0) {
+            LOG_ERROR("Can't read the schema version of {}: {}", db_path, sqlite3_errmsg(db));
+            return false;
+        }
+        if (version != kSchemaVersion) {
+            LOG_ERROR("{} has schema version {}, expected {}; start the server once to migrate it", db_path,
+                      version, kSchemaVersion);
+            return false;
+        }
+        return true;
+    }
+
+    bool insertTransaction(const Money& amount, bool approved, const std::string& auth_code = "", 
+                          const std::string& masked_pan = "", const std::string& rrn = "",
+                          long unix_ts = 0, const std::string& nonce = "") {
+        TransactionRecord record{};
+        record.amount = amount;
+        record.approved = approved;
+        record.unix_ts = unix_ts;
+        copyField(record.auth_code, auth_code);
+        copyField(record.masked_pan, masked_pan);
+        copyField(record.rrn, rrn);
+        copyField(record.nonce, nonce);
+
+        bool ok = false;
+        return insertBatch(&record, 1, &ok) && ok;
+    }
+
+    // Inserts all records inside one transaction. ok[i] reports whether
+    // record i was written; the return value is false if the batch as a
+    // whole could not be committed.
+    // With ids, rows keep the given ids and a row whose id is already
+    // stored is skipped, so replaying the same records twice is harmless.
+    bool insertBatch(const TransactionRecord* records, size_t count, bool* ok, const int64_t* ids = nullptr) {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Failed to begin transaction: {}", sqlite3_errmsg(db));
+            std::fill(ok, ok + count, false);
+            return false;
+        }
+
+        sqlite3_stmt* stmt = ids ? replay_stmt : insert_stmt;
+        for (size_t i = 0; i < count; i++) {
+            const TransactionRecord& r = records[i];
+            sqlite3_bind_int64(stmt, 1, r.amount.minor);
+            sqlite3_bind_text(stmt, 2, r.amount.currency, -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 3, r.approved ? 1 : 0);
+            sqlite3_bind_text(stmt, 4, r.auth_code, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 5, r.masked_pan, -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 6, r.rrn, -1, SQLITE_STATIC);
+            sqlite3_bind_int64(stmt, 7, r.unix_ts);
+            sqlite3_bind_text(stmt, 8, r.nonce, -1, SQLITE_STATIC);
+            if (ids) {
+                sqlite3_bind_int64(stmt, 9, ids[i]);
+            } else if (shard >= 0) {
+                sqlite3_bind_int64(stmt, 9, next_seq * kShardIdStride + shard);
+            }
+
+            ok[i] = sqlite3_step(stmt) == SQLITE_DONE;
+            if (!ok[i]) {
+                LOG_ERROR("Failed to insert transaction: {}", sqlite3_errmsg(db));
+            } else if (shard >= 0 && !ids) {
+                next_seq++;
+            }
+            sqlite3_reset(stmt);
+        }
+        sqlite3_clear_bindings(stmt);
+
+        if (sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Failed to commit transactions: {}", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            std::fill(ok, ok + count, false);
+            return false;
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            if (ok[i]) {
+                LOG_DEBUG("Transaction stored: Amount={} {}, Approved={}", records[i].amount.toString(),
+                          records[i].amount.currencyCode(), records[i].approved);
+            }
+        }
+        return true;
+    }
+
+    // The largest stored id, or -1 if the table is empty.
+    bool maxId(int64_t& max_id) {
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT MAX(id) FROM transactions;", -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Failed to read the id sequence: {}", sqlite3_errmsg(db));
+            return false;
+        }
+        max_id = -1;
+        if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL) {
+            max_id = sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        return true;
+    }
+
+    // Prepares the query; the cursor then streams the matching rows in
+    // (unix_ts, id) order, at most query.limit of them.
+    bool openQuery(const TransactionQuery& query, TransactionCursor& cursor) {
+        // Without bounds the time range is left out of the statement.
+        bool from = query.from_ts != std::numeric_limits<int64_t>::min();
+        bool to = query.to_ts != std::numeric_limits<int64_t>::max();
+        std::string sql = "SELECT id, amount_minor, approved, auth_code, masked_pan, rrn, unix_ts, nonce, currency "
+                          "FROM transactions WHERE 1";
+        if (from) {
+            sql += " AND unix_ts >= ?";
+        }
+        if (to) {
+            sql += " AND unix_ts < ?";
+        }
+        if (query.approved >= 0) {
+            sql += " AND approved = ?";
+        }
+        if (!query.rrn.empty()) {
+            sql += " AND rrn = ?";
+        }
+        if (!query.auth_code.empty()) {
+            sql += " AND auth_code = ?";
+        }
+        const char* key = query.by_id ? "id" : "(unix_ts, id)";
+        if (query.has_cursor) {
+            sql += std::string(" AND ") + key + (query.ascending ? " > " : " < ") + (query.by_id ? "?" : "(?, ?)");
+        }
+        if (query.by_id) {
+            sql += query.ascending ? " ORDER BY id LIMIT ?;" : " ORDER BY id DESC LIMIT ?;";
+        } else {
+            sql += query.ascending ? " ORDER BY unix_ts, id LIMIT ?;" : " ORDER BY unix_ts DESC, id DESC LIMIT ?;";
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Failed to prepare statement: {}", sqlite3_errmsg(db));
+            return false;
+        }
+        int param = 1;
+        if (from) {
+            sqlite3_bind_int64(stmt, param++, query.from_ts);
+        }
+        if (to) {
+            sqlite3_bind_int64(stmt, param++, query.to_ts);
+        }
+        if (query.approved >= 0) {
+            sqlite3_bind_int(stmt, param++, query.approved);
+        }
+        if (!query.rrn.empty()) {
+            sqlite3_bind_text(stmt, param++, query.rrn.c_str(), -1, SQLITE_TRANSIENT);
+        }
+        if (!query.auth_code.empty()) {
+            sqlite3_bind_text(stmt, param++, query.auth_code.c_str(), -1, SQLITE_TRANSIENT);
+        }
+        if (query.has_cursor) {
+            if (!query.by_id) {
+                sqlite3_bind_int64(stmt, param++, query.cursor_ts);
+            }
+            sqlite3_bind_int64(stmt, param++, query.cursor_id);
+        }
+        sqlite3_bind_int64(stmt, param, query.limit);
+
+        if (cursor.stmt) {
+            sqlite3_finalize(cursor.stmt);
+        }
+        cursor.db = db;
+        cursor.stmt = stmt;
+        cursor.error = false;
+        return true;
+    }
+
+private:
+    // PRAGMA user_version, or -1 if it cannot be read.
+    int schemaVersion() {
+        int version = -1;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK) {
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                version = sqlite3_column_int(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return version;
+    }
+
+    // Continues this shard's id sequence after the largest stored id.
+    bool loadNextSeq() {
+        int64_t max_id;
+        if (!maxId(max_id)) {
+            return false;
+        }
+        next_seq = max_id < 0 ? 0 : max_id / kShardIdStride + 1;
+        return true;
+    }
+
+    // Brings an older table up to kSchemaVersion: version 1 has a unix_ts
+    // that may be NULL, which every (unix_ts, id) page cursor and the
+    // cross-file merge would mishandle, so such rows get 0; the gateway
+    // itself always stores a unix_ts. Pre-1 tables are rebuilt below.
+    bool migrate() {
+        int version = schemaVersion();
+        if (version == 1) {
+            if (sqlite3_exec(db, "UPDATE transactions SET unix_ts = 0 WHERE unix_ts IS NULL;", nullptr, nullptr,
+                             nullptr) != SQLITE_OK) {
+                LOG_ERROR("Schema migration failed: {}", sqlite3_errmsg(db));
+                return false;
+            }
+            return true;
+        }
+        if (version >= 1) {
+            return true;
+        }
+        return migrateAmounts();
+    }
+
+    // Moves a pre-1 schema (amount REAL) to amount_minor INTEGER + currency.
+    // SQLite cannot change a column type in place, so the table is rebuilt
+    // inside one transaction; ids and the AUTOINCREMENT sequence are kept.
+    bool migrateAmounts() {
+        sqlite3_stmt* stmt;
+
+        bool legacy = false;
+        if (sqlite3_prepare_v2(db, "SELECT 1 FROM pragma_table_info('transactions') WHERE name = 'amount';",
+                               -1, &stmt, nullptr) == SQLITE_OK) {
+            legacy = sqlite3_step(stmt) == SQLITE_ROW;
+            sqlite3_finalize(stmt);
+        }
+        if (!legacy) {
+            return true;
+        }
+
+        LOG_INFO("Migrating transactions table to integer amounts...");
+        const char* sql = R"(
+            BEGIN;
+            CREATE TABLE transactions_v1 (
+                id INTEGER PRIMARY KEY AUTOINCREMENT,
+                amount_minor INTEGER NOT NULL,
+                currency TEXT NOT NULL DEFAULT 'USD',
+                approved BOOLEAN NOT NULL,
+                auth_code TEXT,
+                masked_pan TEXT,
+                rrn TEXT,
+                unix_ts INTEGER NOT NULL DEFAULT 0,
+                nonce TEXT
+            );
+            INSERT INTO transactions_v1 (id, amount_minor, currency, approved, auth_code, masked_pan, rrn, unix_ts, nonce)
+                SELECT id, CAST(ROUND(amount * 100) AS INTEGER), 'USD', approved, auth_code, masked_pan, rrn,
+                       COALESCE(unix_ts, 0), nonce
+                FROM transactions;
+            DROP TABLE transactions;
+            ALTER TABLE transactions_v1 RENAME TO transactions;
+            PRAGMA user_version = 2;
+            COMMIT;
+        )";
+        if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            LOG_ERROR("Schema migration failed: {}", sqlite3_errmsg(db));
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Collects output in a fixed buffer and hands it to write(2) in 64 KiB
+// chunks, so streaming a large result costs one syscall per chunk instead
+// of a formatted stream insertion per field.
+class BufferedWriter {
+    static constexpr size_t kCapacity = 64 << 10;
+
+    int fd;
+    std::unique_ptr<char[]> buffer;
+    size_t used;
+    bool ok;
+
+public:
+    explicit BufferedWriter(int fd) : fd(fd), buffer(new char[kCapacity]), used(0), ok(true) {}
+
+    BufferedWriter(const BufferedWriter&) = delete;
+    BufferedWriter& operator=(const BufferedWriter&) = delete;
+
+    ~BufferedWriter() {
+        flush();
+    }
+
+    BufferedWriter& operator<<(std::string_view text) {
+        while (!text.empty()) {
+            if (used == kCapacity) {
+                flush();
+            }
+            size_t n = std::min(text.size(), kCapacity - used);
+            memcpy(buffer.get() + used, text.data(), n);
+            used += n;
+            text.remove_prefix(n);
+        }
+        return *this;
+    }
+
+    BufferedWriter& operator<<(char c) {
+        return *this << std::string_view(&c, 1);
+    }
+
+    template <typename T, typename = std::enable_if_t<std::is_integral_v<T>>>
+    BufferedWriter& operator<<(T value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        return *this << std::string_view(digits, result.ptr - digits);
+    }
+
+    // Left-aligns text in a column of the given width, like std::setw.
+    BufferedWriter& pad(std::string_view text, size_t width) {
+        *this << text;
+        for (size_t n = text.size(); n < width; n++) {
+            *this << ' ';
+        }
+        return *this;
+    }
+
+    BufferedWriter& jsonString(std::string_view text) {
+        *this << '"';
+        for (char c : text) {
+            if (c == '"' || c == '\\') {
+                *this << '\\' << c;
+            } else if (static_cast<unsigned char>(c) < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                *this << std::string_view(escaped);
+            } else {
+                *this << c;
+            }
+        }
+        return *this << '"';
+    }
+
+    // False once a write has failed.
+    bool flush() {
+        size_t offset = 0;
+        while (ok && offset < used) {
+            ssize_t n = write(fd, buffer.get() + offset, used - offset);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                ok = false;
+                break;
+            }
+            offset += static_cast<size_t>(n);
+        }
+        used = 0;
+        return ok;
+    }
+};
+
+// Quotes a CSV field if it contains a separator, quote or line break.
+std::string csvField(const std::string& value) {
+    if (value.find_first_of(",\"\r\n") == std::string::npos) {
+        return value;
+    }
+    std::string quoted = "\"";
+    for (char c : value) {
+        if (c == '"') {
+            quoted += '"';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+enum class QueryFormat {
+    Table,
+    Csv,
+    Json
+};
+
+// Writes query results one row at a time in the chosen format. Only the
+// per-currency approved totals of the table footer are kept.
+class TransactionRowWriter {
+    BufferedWriter& out;
+    QueryFormat format;
+    uint64_t rows;
+    std::vector<std::pair<std::string, int64_t>> approved_totals;
+
+public:
+    TransactionRowWriter(BufferedWriter& out, QueryFormat format) : out(out), format(format), rows(0) {}
+
+    void begin(std::string_view title) {
+        if (format == QueryFormat::Csv) {
+            out << "id,amount,currency,status,auth_code,masked_pan,rrn,unix_ts,nonce\n";
+        } else if (format == QueryFormat::Json) {
+            out << "{\"transactions\": [";
+        } else {
+            out << '\n' << title << '\n' << std::string(84, '=') << '\n';
+            out.pad("ID", 8).pad("Amount", 10).pad("Status", 10).pad("Auth", 8).pad("Masked PAN", 18)
+                .pad("RRN", 14).pad("Timestamp", 12) << "Nonce\n";
+            out << std::string(84, '-') << '\n';
+        }
+    }
+
+    void row(const StoredTransaction& row) {
+        const char* status = row.approved ? "APPROVED" : "DECLINED";
+        std::string amount = row.amount.toString();
+        if (format == QueryFormat::Csv) {
+            out << row.id << ',' << amount << ',' << row.amount.currencyCode() << ',' << status << ','
+                << csvField(row.auth_code) << ',' << csvField(row.masked_pan) << ',' << csvField(row.rrn) << ','
+                << row.unix_ts << ',' << csvField(row.nonce) << '\n';
+        } else if (format == QueryFormat::Json) {
+            out << (rows == 0 ? "\n  " : ",\n  ") << "{\"id\": " << row.id << ", \"amount\": \"" << amount
+                << "\", \"currency\": ";
+            out.jsonString(row.amount.currencyCode()) << ", \"status\": \"" << status << "\", \"auth_code\": ";
+            out.jsonString(row.auth_code) << ", \"masked_pan\": ";
+            out.jsonString(row.masked_pan) << ", \"rrn\": ";
+            out.jsonString(row.rrn) << ", \"unix_ts\": " << row.unix_ts << ", \"nonce\": ";
+            out.jsonString(row.nonce) << '}';
+        } else {
+            out.pad(std::to_string(row.id), 8) << '$';
+            out.pad(amount, 8).pad(status, 10).pad(row.auth_code, 8).pad(row.masked_pan, 18).pad(row.rrn, 14)
+                .pad(std::to_string(row.unix_ts), 12) << row.nonce << '\n';
+            if (row.approved) {
+                std::string_view code = row.amount.currencyCode();
+                auto total = std::find_if(approved_totals.begin(), approved_totals.end(),
+                                          [&](const auto& entry) { return entry.first == code; });
+                if (total == approved_totals.end()) {
+                    approved_totals.emplace_back(std::string(code), row.amount.minor);
+                } else {
+                    total->second += row.amount.minor;
+                }
+            }
+        }
+        rows++;
+    }
+
+    // next_cursor is empty on the last page.
+    void end(const std::string& next_cursor) {
+        if (format == QueryFormat::Csv) {
+            if (!next_cursor.empty()) {
+                std::cerr << "Next page: --after " << next_cursor << std::endl;
+            }
+        } else if (format == QueryFormat::Json) {
+            out << (rows == 0 ? "" : "\n") << "], \"count\": " << rows << ", \"next_cursor\": ";
+            if (next_cursor.empty()) {
+                out << "null";
+            } else {
+                out.jsonString(next_cursor);
+            }
+            out << "}\n";
+        } else if (rows == 0) {
+            out << "No transactions found in database.\n";
+        } else {
+            out << std::string(84, '=') << '\n';
+            out << "Total: " << rows << " transaction(s) displayed\n";
+            for (const auto& total : approved_totals) {
+                out << "Approved amount: " << formatMinorUnits(total.second) << ' ' << total.first << '\n';
+            }
+            if (!next_cursor.empty()) {
+                out << "Next page: --after " << next_cursor << '\n';
+            }
+        }
+    }
+};
+
+// The database files of the current directory: every shard file that
+// exists (a run with fewer workers leaves gaps, so all indexes are
+// checked) plus transactions.db if it also exists, else transactions.db.
+std::vector<std::string> transactionDatabasePaths() {
+    std::vector<std::string> paths;
+    for (int shard = 0; shard < kShardIdStride; shard++) {
+        std::string path = shardDatabasePath(shard);
+        if (access(path.c_str(), F_OK) == 0) {
+            paths.push_back(path);
+        }
+    }
+    if (paths.empty() || access("transactions.db", F_OK) == 0) {
+        paths.push_back("transactions.db");
+    }
+    return paths;
+}
+
+// Streams the rows matching query from the given database files, merged
+// into one (unix_ts, id) order, or id order with by_id. Each file streams
+// its own ordered result and a heap holds just the current row of each,
+// so memory does not grow with the result. A limit applies to the merged
+// output, so each file needs to supply at most one row more than that:
+// the extra row only tells whether another page exists. With paginate, a
+// page followed by more rows ends with the cursor of the next one.
+bool streamTransactions(const std::vector<std::string>& paths, const TransactionQuery& query,
+                        BufferedWriter& out, QueryFormat format, std::string_view title, bool paginate = true) {
+    std::vector<std::unique_ptr<TransactionDB>> dbs;
+    std::vector<TransactionCursor> cursors(paths.size());
+    std::vector<StoredTransaction> heads(paths.size());
+    TransactionQuery per_file = query;
+    if (query.limit >= 0) {
+        per_file.limit = query.limit + 1;
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+        dbs.push_back(std::make_unique<TransactionDB>());
+        if (!dbs.back()->openReadOnly(paths[i])) {
+            std::cerr << "Failed to open database " << paths[i] << std::endl;
+            return false;
+        }
+        if (!dbs.back()->openQuery(per_file, cursors[i])) {
+            return false;
+        }
+    }
+
+    // Orders the heap so that its top is the next row to write.
+    auto later = [&](size_t a, size_t b) {
+        const StoredTransaction& x = heads[a];
+        const StoredTransaction& y = heads[b];
+        long x_ts = query.by_id ? 0 : x.unix_ts;
+        long y_ts = query.by_id ? 0 : y.unix_ts;
+        return query.ascending ? std::tie(x_ts, x.id) > std::tie(y_ts, y.id)
+                               : std::tie(x_ts, x.id) < std::tie(y_ts, y.id);
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> ready(later);
+    for (size_t i = 0; i < cursors.size(); i++) {
+        if (cursors[i].next(heads[i])) {
+            ready.push(i);
+        }
+    }
+
+    TransactionRowWriter writer(out, format);
+    writer.begin(title);
+    int64_t written = 0;
+    std::string next_cursor;
+    int64_t last_ts = 0, last_id = 0;
+    while (!ready.empty()) {
+        size_t i = ready.top();
+        if (written == query.limit) {
+            if (paginate) {
+                next_cursor = std::to_string(last_ts) + ":" + std::to_string(last_id);
+            }
+            break;
+        }
+        ready.pop();
+        writer.row(heads[i]);
+        written++;
+        last_ts = heads[i].unix_ts;
+        last_id = heads[i].id;
+        if (cursors[i].next(heads[i])) {
+            ready.push(i);
+        }
+    }
+
+    for (const auto& cursor : cursors) {
+        if (cursor.failed()) {
+            return false;
+        }
+    }
+    writer.end(next_cursor);
+    return out.flush();
+}
+
+// Newest by id within a single file, where ids follow insertion order.
+// Ids of different files are unrelated - AUTOINCREMENT in transactions.db,
+// seq * kShardIdStride + shard in each shard - so across files the rows
+// are merged by (unix_ts, id) instead.
+bool showLastTransactions(int n) {
+    std::vector<std::string> paths = transactionDatabasePaths();
+    TransactionQuery query;
+    query.limit = n;
+    query.by_id = paths.size() == 1;
+    BufferedWriter out(STDOUT_FILENO);
+    return streamTransactions(paths, query, out, QueryFormat::Table, "Last " + std::to_string(n) + " transactions:",
+                              false);
+}
+
+uint32_t crc32(const void* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> entries{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+            }
+            entries[i] = crc;
+        }
+        return entries;
+    }();
+    uint32_t crc = 0xFFFFFFFFu;
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc ^ 0xFFFFFFFFu;
+}
+
+// One journal slot. A slot is valid when magic is set and crc matches the
+// bytes that follow it; the zero-filled tail of a segment never is.
+struct JournalRecord {
+    uint32_t magic;
+    uint32_t crc;
+    int64_t id;
+    int64_t amount_minor;
+    int64_t unix_ts;
+    char currency[4];
+    uint8_t approved;
+    char auth_code[8];
+    char masked_pan[24];
+    char rrn[16];
+    char nonce[20];
+    char reserved[23];
+};
+
+static_assert(sizeof(JournalRecord) == 128, "journal records are fixed at 128 bytes");
+
+// Append-only store for approved and declined AUTHs: fixed-size records are
+// copied into a pre-allocated, memory-mapped segment file, so the writer's
+// hot path is a memcpy plus, with Sync::Batch, one msync per batch. Full
+// segments are sealed and a compactor thread loads them into the SQLite
+// transactions table, then deletes them. open() first replays whatever an
+// earlier run left behind; every record carries its final id, so loading a
+// segment twice is harmless.
+class TransactionJournal {
+public:
+    enum class Sync {
+        Batch,
+        Periodic
+    };
+
+private:
+    static constexpr uint32_t kRecordMagic = 0x314A5750;  // "PWJ1"
+
+    struct Segment {
+        uint64_t index = 0;
+        int fd = -1;
+        JournalRecord* slots = nullptr;
+        size_t used = 0;
+    };
+
+    TransactionDB& db;
+    std::string dir;
+    std::string prefix;
+    size_t segment_records;
+    Sync sync;
+    int sync_interval_ms;
+    int64_t id_stride;
+    int64_t id_offset;
+    int64_t next_seq;
+
+    Segment active;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::string> sealed;
+    bool stopping;
+    std::thread compactor;
+
+public:
+    TransactionJournal(TransactionDB& db, std::string dir, std::string prefix, size_t segment_records,
+                       Sync sync, int sync_interval_ms)
+        : db(db), dir(std::move(dir)), prefix(std::move(prefix)), segment_records(std::max<size_t>(segment_records, 1)),
+          sync(sync), sync_interval_ms(std::max(sync_interval_ms, 1)), id_stride(1), id_offset(0), next_seq(0),
+          stopping(false) {}
+
+    ~TransactionJournal() {
+        close();
+    }
+
+    // Replays leftover segments into the database, then opens a fresh
+    // segment and starts the compactor. shard >= 0 gives ids from that
+    // shard's sequence, as TransactionDB does.
+    bool open(int shard) {
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            LOG_ERROR("Failed to create journal directory {}: {}", dir, strerror(errno));
+            return false;
+        }
+
+        std::vector<std::pair<uint64_t, std::string>> leftovers;
+        if (!listSegments(leftovers)) {
+            return false;
+        }
+        uint64_t next_index = 0;
+        size_t replayed = 0;
+        for (const auto& [index, path] : leftovers) {
+            if (!compact(path, &replayed)) {
+                return false;
+            }
+            next_index = index + 1;
+        }
+        if (!leftovers.empty()) {
+            LOG_INFO("Replayed {} journal record(s) from {} segment(s) in {}", replayed, leftovers.size(), dir);
+        }
+
+        int64_t max_id;
+        if (!db.maxId(max_id)) {
+            return false;
+        }
+        id_stride = shard >= 0 ? kShardIdStride : 1;
+        id_offset = shard >= 0 ? shard : 0;
+        if (max_id < 0) {
+            next_seq = shard >= 0 ? 0 : 1;
+        } else {
+            next_seq = (max_id - id_offset) / id_stride + 1;
+        }
+
+        if (!openSegment(next_index)) {
+            return false;
+        }
+        compactor = std::thread([this] { runCompactor(); });
+        return true;
+    }
+
+    // Seals the active segment and waits for the compactor to load every
+    // segment into the database. Call after the writer has stopped.
+    void close() {
+        if (!compactor.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sealActive();
+            stopping = true;
+        }
+        wake.notify_one();
+        compactor.join();
+    }
+
+    // Called by the writer thread only. ok[i] is set once record i is in
+    // the journal, and with Sync::Batch also flushed to disk.
+    bool append(const TransactionRecord* records, size_t count, bool* ok) {
+        size_t first = active.used;
+        for (size_t i = 0; i < count; i++) {
+            if (active.used == segment_records) {
+                if (!flush(first) || !rotate()) {
+                    std::fill(ok + i, ok + count, false);
+                    return false;
+                }
+                first = 0;
+            }
+            encode(records[i], next_seq * id_stride + id_offset, active.slots[active.used++]);
+            next_seq++;
+            ok[i] = true;
+        }
+        if (!flush(first)) {
+            std::fill(ok, ok + count, false);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::string segmentPath(uint64_t index) const {
+        char name[32];
+        snprintf(name, sizeof(name), ".%08llu.seg", static_cast<unsigned long long>(index));
+        return dir + "/" + prefix + name;
+    }
+
+    bool listSegments(std::vector<std::pair<uint64_t, std::string>>& segments) const {
+        DIR* handle = opendir(dir.c_str());
+        if (!handle) {
+            LOG_ERROR("Failed to read journal directory {}: {}", dir, strerror(errno));
+            return false;
+        }
+        while (dirent* entry = readdir(handle)) {
+            std::string_view name(entry->d_name);
+            if (name.size() != prefix.size() + 13 || name.substr(0, prefix.size()) != prefix ||
+                name[prefix.size()] != '.' || name.substr(name.size() - 4) != ".seg") {
+                continue;
+            }
+            std::string_view digits = name.substr(prefix.size() + 1, 8);
+            uint64_t index = 0;
+            auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), index);
+            if (ec == std::errc() && end == digits.data() + digits.size()) {
+                segments.emplace_back(index, dir + "/" + std::string(name));
+            }
+        }
+        closedir(handle);
+        std::sort(segments.begin(), segments.end());
+        return true;
+    }
+
+    bool openSegment(uint64_t index) {
+        std::string path = segmentPath(index);
+        size_t bytes = segment_records * sizeof(JournalRecord);
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            LOG_ERROR("Failed to create journal segment {}: {}", path, strerror(errno));
+            return false;
+        }
+        // Allocate up front so a full disk fails here, not as SIGBUS on a store.
+        int rc = posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+        void* map = rc == 0 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        if (map == MAP_FAILED) {
+            LOG_ERROR("Failed to map journal segment {}: {}", path, strerror(rc ? rc : errno));
+            ::close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        active.index = index;
+        active.fd = fd;
+        active.slots = static_cast<JournalRecord*>(map);
+        active.used = 0;
+        return true;
+    }
+
+    // Requires mutex.
+    void sealActive() {
+        if (!active.slots) {
+            return;
+        }
+        size_t bytes = segment_records * sizeof(JournalRecord);
+        msync(active.slots, bytes, MS_SYNC);
+        munmap(active.slots, bytes);
+        ::close(active.fd);
+        sealed.push_back(segmentPath(active.index));
+        active.slots = nullptr;
+        active.fd = -1;
+    }
+
+    bool rotate() {
+        uint64_t index = active.index + 1;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            sealActive();
+        }
+        wake.notify_one();
+        return openSegment(index);
+    }
+
+    // With Sync::Batch, flushes the pages holding slots [first, used).
+    bool flush(size_t first) {
+        if (sync != Sync::Batch || first == active.used) {
+            return true;
+        }
+        static const uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        uintptr_t begin = reinterpret_cast<uintptr_t>(active.slots + first) & ~(page_size - 1);
+        uintptr_t end = reinterpret_cast<uintptr_t>(active.slots + active.used);
+        if (msync(reinterpret_cast<void*>(begin), end - begin, MS_SYNC) != 0) {
+            LOG_ERROR("Failed to sync journal segment: {}", strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    static void encode(const TransactionRecord& record, int64_t id, JournalRecord& slot) {
+        JournalRecord entry{};
+        entry.id = id;
+        entry.amount_minor = record.amount.minor;
+        entry.unix_ts = record.unix_ts;
+        memcpy(entry.currency, record.amount.currency, sizeof(entry.currency));
+        entry.approved = record.approved ? 1 : 0;
+        copyField(entry.auth_code, record.auth_code);
+        copyField(entry.masked_pan, record.masked_pan);
+        copyField(entry.rrn, record.rrn);
+        copyField(entry.nonce, record.nonce);
+        entry.magic = kRecordMagic;
+        entry.crc = crc32(&entry.id, sizeof(entry) - offsetof(JournalRecord, id));
+        memcpy(&slot, &entry, sizeof(entry));
+    }
+
+    static bool decode(const JournalRecord& slot, TransactionRecord& record) {
+        if (slot.magic != kRecordMagic || slot.crc != crc32(&slot.id, sizeof(slot) - offsetof(JournalRecord, id))) {
+            return false;
+        }
+        record = TransactionRecord{};
+        record.amount = Money::fromMinor(slot.amount_minor, std::string_view(slot.currency, strnlen(slot.currency, 4)));
+        record.approved = slot.approved != 0;
+        record.unix_ts = slot.unix_ts;
+        copyField(record.auth_code, std::string_view(slot.auth_code, strnlen(slot.auth_code, sizeof(slot.auth_code))));
+        copyField(record.masked_pan, std::string_view(slot.masked_pan, strnlen(slot.masked_pan, sizeof(slot.masked_pan))));
+        copyField(record.rrn, std::string_view(slot.rrn, strnlen(slot.rrn, sizeof(slot.rrn))));
+        copyField(record.nonce, std::string_view(slot.nonce, strnlen(slot.nonce, sizeof(slot.nonce))));
+        return true;
+    }
+
+    // Loads every valid record of a sealed or leftover segment into the
+    // database and deletes the file. Torn or never-written slots are
+    // skipped; they were never acknowledged.
+    bool compact(const std::string& path, size_t* loaded = nullptr) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            LOG_ERROR("Failed to open journal segment {}: {}", path, strerror(errno));
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            LOG_ERROR("Failed to stat journal segment {}: {}", path, strerror(errno));
+            ::close(fd);
+            return false;
+        }
+        size_t slots = static_cast<size_t>(info.st_size) / sizeof(JournalRecord);
+        std::vector<TransactionRecord> records;
+        std::vector<int64_t> ids;
+        if (slots > 0) {
+            void* map = mmap(nullptr, slots * sizeof(JournalRecord), PROT_READ, MAP_SHARED, fd, 0);
+            if (map == MAP_FAILED) {
+                LOG_ERROR("Failed to map journal segment {}: {}", path, strerror(errno));
+                ::close(fd);
+                return false;
+            }
+            const JournalRecord* entries = static_cast<const JournalRecord*>(map);
+            for (size_t i = 0; i < slots; i++) {
+                TransactionRecord record;
+                if (decode(entries[i], record)) {
+                    records.push_back(record);
+                    ids.push_back(entries[i].id);
+                }
+            }
+            munmap(map, slots * sizeof(JournalRecord));
+        }
+        ::close(fd);
+
+        if (!records.empty()) {
+            std::unique_ptr<bool[]> ok(new bool[records.size()]);
+            if (!db.insertBatch(records.data(), records.size(), ok.get(), ids.data()) ||
+                !std::all_of(ok.get(), ok.get() + records.size(), [](bool stored) { return stored; })) {
+                LOG_ERROR("Failed to compact journal segment {}; keeping it", path);
+                return false;
+            }
+        }
+        if (loaded) {
+            *loaded += records.size();
+        }
+        unlink(path.c_str());
+        LOG_DEBUG("Compacted {} journal record(s) from {}", records.size(), path);
+        return true;
+    }
+
+    // Loads sealed segments as they appear and, with Sync::Periodic,
+    // flushes the active segment every sync_interval_ms.
+    void runCompactor() {
+        int interval_ms = sync == Sync::Periodic ? sync_interval_ms : 1000;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                          [this] { return stopping || !sealed.empty(); });
+            if (sync == Sync::Periodic && active.slots) {
+                msync(active.slots, segment_records * sizeof(JournalRecord), MS_SYNC);
+            }
+            while (!sealed.empty()) {
+                std::string path = sealed.front();
+                lock.unlock();
+                bool done = compact(path);
+                lock.lock();
+                if (!done) {
+                    break;
+                }
+                sealed.pop_front();
+            }
+            if (stopping) {
+                if (!sealed.empty()) {
+                    LOG_WARN("{} journal segment(s) left in {} for replay on the next start", sealed.size(), dir);
+                }
+                break;
+            }
+        }
+    }
+};
+
+template <typename T>
+class BoundedMpscQueue {
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueue_pos;
+    alignas(64) std::atomic<size_t> dequeue_pos;
+
+public:
+    explicit BoundedMpscQueue(size_t capacity) : enqueue_pos(0), dequeue_pos(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.reset(new Slot[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(const T& value) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    slot.value = value;
+                    slot.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer only.
+    bool tryPop(T& value) {
+        size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        Slot& slot = slots[pos & mask];
+        size_t seq = slot.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1) < 0) {
+            return false;
+        }
+        value = slot.value;
+        slot.sequence.store(pos + mask + 1, std::memory_order_release);
+        dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    size_t sizeApprox() const {
+        size_t head = dequeue_pos.load(std::memory_order_relaxed);
+        size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+};
+
+// Log-linear histogram in the spirit of HdrHistogram. Values below 128 are
+// exact; above that each power of two is split into 64 sub-buckets, so a
+// reported value is within 1/64 of the recorded one over the full range.
+class LatencyHistogram {
+public:
+    static constexpr int kSubBucketBits = 6;
+    static constexpr uint64_t kSubBuckets = 1ull << kSubBucketBits;
+    static constexpr size_t kBucketCount = 2 * kSubBuckets + (64 - kSubBucketBits - 1) * kSubBuckets;
+
+private:
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+    double sum;
+
+public:
+    LatencyHistogram() : counts(kBucketCount, 0), total(0), max_value(0), sum(0) {}
+
+    void record(uint64_t value) {
+        counts[bucketOf(value)]++;
+        total++;
+        sum += static_cast<double>(value);
+        max_value = std::max(max_value, value);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < kBucketCount; i++) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        max_value = std::max(max_value, other.max_value);
+    }
+
+    uint64_t count() const {
+        return total;
+    }
+
+    uint64_t max() const {
+        return max_value;
+    }
+
+    double mean() const {
+        return total ? sum / total : 0.0;
+    }
+
+    // Smallest bucket bound that at least `percent` of the values are at or below.
+    uint64_t percentile(double percent) const {
+        if (total == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(std::ceil(percent / 100.0 * total));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kBucketCount; i++) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(upperBound(i), max_value);
+            }
+        }
+        return max_value;
+    }
+
+    static size_t bucketOf(uint64_t value) {
+        if (value < 2 * kSubBuckets) {
+            return static_cast<size_t>(value);
+        }
+        int shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return 2 * kSubBuckets + (shift - 1) * kSubBuckets + ((value >> shift) - kSubBuckets);
+    }
+
+    static uint64_t upperBound(size_t bucket) {
+        if (bucket < 2 * kSubBuckets) {
+            return bucket;
+        }
+        size_t shift = (bucket - 2 * kSubBuckets) / kSubBuckets + 1;
+        uint64_t sub = (bucket - 2 * kSubBuckets) % kSubBuckets + kSubBuckets;
+        return ((sub + 1) << shift) - 1;
+    }
+};
+
+enum class MetricCounter : int {
+    Accepts,
+    HandshakeFailures,
+    AuthParseErrors,
+    Approvals,
+    Declines,
+    DbErrors,
+    Shed,
+    RateLimited,
+    Count
+};
+
+enum class MetricGauge : int {
+    OpenConnections,
+    Count
+};
+
+enum class MetricTimer : int {
+    Parse,
+    Decision,
+    Db,
+    Send,
+    Count
+};
+
+// Process-wide counters, gauges and latency histograms. Each thread updates
+// only its own shard with relaxed stores, so recording never contends; a
+// scrape sums the shards and renders Prometheus text format.
+class Metrics {
+private:
+    static constexpr size_t kCounters = static_cast<size_t>(MetricCounter::Count);
+    static constexpr size_t kGauges = static_cast<size_t>(MetricGauge::Count);
+    static constexpr size_t kTimers = static_cast<size_t>(MetricTimer::Count);
+
+    struct Shard {
+        std::atomic<uint64_t> counters[kCounters] = {};
+        std::atomic<int64_t> gauges[kGauges] = {};
+        std::atomic<uint64_t> timer_sum_ns[kTimers] = {};
+        std::atomic<uint64_t> timer_buckets[kTimers][LatencyHistogram::kBucketCount] = {};
+    };
+
+    struct Descriptor {
+        const char* name;
+        const char* help;
+    };
+
+    static constexpr Descriptor kCounterInfo[kCounters] = {
+        {"posgw_accepts_total", "Accepted client connections."},
+        {"posgw_handshake_failures_total", "Connections closed for a bad or missing HELLO."},
+        {"posgw_auth_parse_errors_total", "AUTH lines rejected by the parser."},
+        {"posgw_approvals_total", "AUTH requests approved."},
+        {"posgw_declines_total", "AUTH requests declined by a rule."},
+        {"posgw_db_errors_total", "Transactions the database failed to store."},
+        {"posgw_shed_total", "AUTH requests answered DECLINED|BUSY because a queue was over its watermark."},
+        {"posgw_rate_limited_total", "AUTH requests refused by the per-source token bucket."},
+    };
+
+    static constexpr Descriptor kGaugeInfo[kGauges] = {
+        {"posgw_open_connections", "Client connections currently open."},
+    };
+
+    static constexpr Descriptor kTimerInfo[kTimers] = {
+        {"posgw_parse_seconds", "Time spent parsing an AUTH line."},
+        {"posgw_decision_seconds", "Time from a parsed AUTH to its reply text."},
+        {"posgw_db_seconds", "Time from handing a transaction to the writer until it is committed."},
+        {"posgw_send_seconds", "Time spent writing replies to a socket."},
+    };
+
+    std::mutex shards_mutex;
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Metrics() = default;
+
+public:
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static void increment(MetricCounter counter, uint64_t n = 1) {
+        auto& value = localShard().counters[static_cast<size_t>(counter)];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static void addGauge(MetricGauge gauge, int64_t delta) {
+        auto& value = localShard().gauges[static_cast<size_t>(gauge)];
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    static void observe(MetricTimer timer, std::chrono::steady_clock::duration elapsed) {
+        uint64_t ns = static_cast<uint64_t>(std::max<int64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(), 0));
+        Shard& shard = localShard();
+        size_t t = static_cast<size_t>(timer);
+        auto& bucket = shard.timer_buckets[t][LatencyHistogram::bucketOf(ns)];
+        bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        auto& sum = shard.timer_sum_ns[t];
+        sum.store(sum.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    }
+
+    std::string renderPrometheus() {
+        static constexpr double kBoundsSeconds[] = {1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+                                                    0.01, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0};
+        constexpr size_t kBounds = sizeof(kBoundsSeconds) / sizeof(kBoundsSeconds[0]);
+
+        uint64_t counters[kCounters] = {};
+        int64_t gauges[kGauges] = {};
+        uint64_t sums[kTimers] = {};
+        std::vector<uint64_t> buckets(kTimers * LatencyHistogram::kBucketCount, 0);
+        {
+            std::lock_guard<std::mutex> lock(shards_mutex);
+            for (const auto& shard : shards) {
+                for (size_t i = 0; i < kCounters; i++) {
+                    counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+                }
+                for (size_t i = 0; i < kGauges; i++) {
+                    gauges[i] += shard->gauges[i].load(std::memory_order_relaxed);
+                }
+                for (size_t t = 0; t < kTimers; t++) {
+                    sums[t] += shard->timer_sum_ns[t].load(std::memory_order_relaxed);
+                    for (size_t b = 0; b < LatencyHistogram::kBucketCount; b++) {
+                        buckets[t * LatencyHistogram::kBucketCount + b] +=
+                            shard->timer_buckets[t][b].load(std::memory_order_relaxed);
+                    }
+                }
+            }
+        }
+
+        std::ostringstream out;
+        for (size_t i = 0; i < kCounters; i++) {
+            out << "# HELP " << kCounterInfo[i].name << ' ' << kCounterInfo[i].help << '\n'
+                << "# TYPE " << kCounterInfo[i].name << " counter\n"
+                << kCounterInfo[i].name << ' ' << counters[i] << '\n';
+        }
+        for (size_t i = 0; i < kGauges; i++) {
+            out << "# HELP " << kGaugeInfo[i].name << ' ' << kGaugeInfo[i].help << '\n'
+                << "# TYPE " << kGaugeInfo[i].name << " gauge\n"
+                << kGaugeInfo[i].name << ' ' << gauges[i] << '\n';
+        }
+        for (size_t t = 0; t < kTimers; t++) {
+            // Folds the fine log-linear buckets into the exported "le" bounds.
+            uint64_t cumulative[kBounds + 1] = {};
+            for (size_t b = 0; b < LatencyHistogram::kBucketCount; b++) {
+                uint64_t n = buckets[t * LatencyHistogram::kBucketCount + b];
+                if (n == 0) {
+                    continue;
+                }
+                double upper_s = LatencyHistogram::upperBound(b) * 1e-9;
+                size_t slot = 0;
+                while (slot < kBounds && upper_s > kBoundsSeconds[slot]) {
+                    slot++;
+                }
+                cumulative[slot] += n;
+            }
+
+            const char* name = kTimerInfo[t].name;
+            out << "# HELP " << name << ' ' << kTimerInfo[t].help << '\n'
+                << "# TYPE " << name << " histogram\n";
+            uint64_t running = 0;
+            for (size_t i = 0; i < kBounds; i++) {
+                running += cumulative[i];
+                out << name << "_bucket{le=\"" << kBoundsSeconds[i] << "\"} " << running << '\n';
+            }
+            running += cumulative[kBounds];
+            out << name << "_bucket{le=\"+Inf\"} " << running << '\n'
+                << name << "_sum " << sums[t] * 1e-9 << '\n'
+                << name << "_count " << running << '\n';
+        }
+        return out.str();
+    }
+
+private:
+    static Shard& localShard() {
+        thread_local Shard* shard = nullptr;
+        if (!shard) {
+            auto owned = std::make_unique<Shard>();
+            shard = owned.get();
+            Metrics& metrics = instance();
+            std::lock_guard<std::mutex> lock(metrics.shards_mutex);
+            metrics.shards.push_back(std::move(owned));
+        }
+        return *shard;
+    }
+};
+
+enum class TracePhase : uint8_t {
+    Accept,
+    HandshakeComplete,
+    LineFramed,
+    Parsed,
+    Decided,
+    Enqueued,
+    Committed,
+    ReplySent
+};
+
+// One timestamped step of a request: conn_id is unique across workers and
+// seq is the reply sequence number of the request on that connection.
+struct TraceRecord {
+    uint64_t ts_ns;
+    uint64_t conn_id;
+    uint32_t seq;
+    uint16_t thread;
+    uint8_t phase;
+    uint8_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 24, "trace records are written to disk as-is");
+
+// Optional request tracing. Each thread appends to its own preallocated
+// buffer and writes it to the trace file when it fills up; whatever is left
+// is written by close(). Disabled tracing costs one load of a flag that
+// never changes while the server runs.
+class Tracer {
+private:
+    static constexpr size_t kBufferRecords = 16384;
+
+    struct Buffer {
+        std::unique_ptr<TraceRecord[]> records{new TraceRecord[kBufferRecords]};
+        size_t used = 0;
+        uint16_t thread = 0;
+    };
+
+    static inline bool active = false;
+
+    int fd;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Buffer>> buffers;
+
+    Tracer() : fd(-1) {}
+
+public:
+    static constexpr char kMagic[8] = {'P', 'O', 'S', 'G', 'W', 'T', 'R', '1'};
+    static constexpr uint32_t kNoSeq = UINT32_MAX;
+
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    static bool enabled() {
+        return __builtin_expect(active, false);
+    }
+
+    // Must be called before any thread that records is started.
+    bool open(const std::string& path) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            return false;
+        }
+        if (write(fd, kMagic, sizeof(kMagic)) != static_cast<ssize_t>(sizeof(kMagic))) {
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        active = true;
+        return true;
+    }
+
+    // Must be called after every recording thread has stopped.
+    void close() {
+        if (fd == -1) {
+            return;
+        }
+        active = false;
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& buffer : buffers) {
+            writeBuffer(*buffer);
+        }
+        ::close(fd);
+        fd = -1;
+    }
+
+    static void record(TracePhase phase, uint64_t conn_id, uint64_t seq) {
+        Buffer& buffer = instance().localBuffer();
+        TraceRecord& rec = buffer.records[buffer.used++];
+        rec.ts_ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+        rec.conn_id = conn_id;
+        rec.seq = static_cast<uint32_t>(seq);
+        rec.thread = buffer.thread;
+        rec.phase = static_cast<uint8_t>(phase);
+        rec.reserved = 0;
+        if (buffer.used == kBufferRecords) {
+            Tracer& tracer = instance();
+            std::lock_guard<std::mutex> lock(tracer.mutex);
+            tracer.writeBuffer(buffer);
+        }
+    }
+
+private:
+    Buffer& localBuffer() {
+        thread_local Buffer* buffer = nullptr;
+        if (!buffer) {
+            auto owned = std::make_unique<Buffer>();
+            buffer = owned.get();
+            std::lock_guard<std::mutex> lock(mutex);
+            owned->thread = static_cast<uint16_t>(buffers.size());
+            buffers.push_back(std::move(owned));
+        }
+        return *buffer;
+    }
+
+    void writeBuffer(Buffer& buffer) {
+        const char* data = reinterpret_cast<const char*>(buffer.records.get());
+        size_t remaining = buffer.used * sizeof(TraceRecord);
+        while (remaining > 0) {
+            ssize_t n = write(fd, data, remaining);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            data += n;
+            remaining -= n;
+        }
+        buffer.used = 0;
+    }
+};
+
+inline void trace(TracePhase phase, uint64_t conn_id, uint64_t seq = Tracer::kNoSeq) {
+    if (Tracer::enabled()) {
+        Tracer::record(phase, conn_id, seq);
+    }
+}
+
+enum class Durability {
+    Commit,
+    Enqueue
+};
+
+class CommitListener;
+
+struct PendingTransaction {
+    TransactionRecord record;
+    CommitListener* listener;
+    uint64_t conn_id;
+    uint64_t reply_seq;
+    std::chrono::steady_clock::time_point enqueued_at;
+    // True if the reply is held until the listener hears of the commit.
+    bool awaited;
+};
+
+class CommitListener {
+public:
+    virtual ~CommitListener() = default;
+    virtual void onCommitted(const PendingTransaction& txn, bool ok) = 0;
+};
+
+class TransactionWriter {
+private:
+    TransactionDB& db;
+    TransactionJournal* journal;
+    BoundedMpscQueue<PendingTransaction> queue;
+    size_t batch_size;
+    int flush_interval_ms;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::atomic<bool> sleeping;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+
+public:
+    // With a journal, batches are appended to it instead of the database.
+    TransactionWriter(TransactionDB& db, size_t batch_size, int flush_interval_ms, size_t queue_capacity = 65536,
+                      TransactionJournal* journal = nullptr)
+        : db(db), journal(journal), queue(queue_capacity), batch_size(std::max<size_t>(batch_size, 1)),
+          flush_interval_ms(flush_interval_ms), running(false), sleeping(false) {}
+
+    ~TransactionWriter() {
+        stop();
+    }
+
+    void start() {
+        running = true;
+        thread = std::thread([this] { run(); });
+    }
+
+    // Stops accepting work once the queue is drained and joins the thread.
+    void stop() {
+        if (!thread.joinable()) {
+            return;
+        }
+        running = false;
+        {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            wake.notify_one();
+        }
+        thread.join();
+    }
+
+    bool submit(const PendingTransaction& txn) {
+        if (!queue.tryPush(txn)) {
+            return false;
+        }
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(wake_mutex);
+            wake.notify_one();
+        }
+        return true;
+    }
+
+    size_t backlog() const {
+        return queue.sizeApprox();
+    }
+
+private:
+    void run() {
+        std::vector<PendingTransaction> batch;
+        std::vector<TransactionRecord> records;
+        std::unique_ptr<bool[]> ok(new bool[batch_size]);
+        batch.reserve(batch_size);
+        records.reserve(batch_size);
+
+        while (true) {
+            PendingTransaction txn;
+            if (!queue.tryPop(txn)) {
+                if (!running) {
+                    break;
+                }
+                waitForWork(std::chrono::steady_clock::now() + std::chrono::milliseconds(100));
+                continue;
+            }
+
+            batch.clear();
+            batch.push_back(txn);
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(flush_interval_ms);
+            while (batch.size() < batch_size) {
+                if (queue.tryPop(txn)) {
+                    batch.push_back(txn);
+                    continue;
+                }
+                if (!running || std::chrono::steady_clock::now() >= deadline) {
+                    break;
+                }
+                waitForWork(deadline);
+            }
+
+            records.clear();
+            for (const auto& pending : batch) {
+                records.push_back(pending.record);
+            }
+            if (journal) {
+                journal->append(records.data(), records.size(), ok.get());
+            } else {
+                db.insertBatch(records.data(), records.size(), ok.get());
+            }
+
+            auto committed_at = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < batch.size(); i++) {
+                Metrics::observe(MetricTimer::Db, committed_at - batch[i].enqueued_at);
+                trace(TracePhase::Committed, batch[i].conn_id, batch[i].reply_seq);
+                if (!ok[i]) {
+                    Metrics::increment(MetricCounter::DbErrors);
+                }
+                if (batch[i].listener) {
+                    batch[i].listener->onCommitted(batch[i], ok[i]);
+                }
+            }
+        }
+    }
+
+    void waitForWork(std::chrono::steady_clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (queue.sizeApprox() == 0 && running) {
+            wake.wait_until(lock, deadline);
+        }
+        sleeping.store(false, std::memory_order_relaxed);
+    }
+};
+
+// Per-thread ID source. Random IDs come from a xoshiro256** generator seeded
+// once per thread. RRNs are not random: they are "SSSSS WW QQQQQ" - the unix
+// second modulo 10^5, a per-thread slot (0-99) and a per-second sequence -
+// so no two threads, and no two calls, hand out the same RRN within the
+// ~27.7 hour cycle of the seconds field. The seconds field is never ahead
+// of the clock and never the second the process started in: a thread
+// that has used up a second's sequence, or asks during the start second,
+// waits for the next one. So every RRN of a process lies after its start
+// and no later than its exit, which keeps a quick restart clear of the
+// old RRNs. Only threads that generate RRNs claim a slot, on their first rrn() call;
+// slots are never reused, and running out of them aborts rather than
+// handing out duplicates.
+class IdGenerator {
+public:
+    static constexpr unsigned kRrnSlots = 100;
+
+private:
+    struct State {
+        uint64_t s[4];
+        unsigned slot;
+        int64_t rrn_second;
+        uint32_t rrn_seq;
+    };
+
+    static constexpr uint32_t kRrnPerSecond = 100000;
+    static constexpr unsigned kNoSlot = ~0u;
+
+    static std::atomic<unsigned>& slotCounter() {
+        static std::atomic<unsigned> counter{0};
+        return counter;
+    }
+
+    static int64_t currentSecond() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    static int64_t processStartSecond() {
+        static const int64_t start = currentSecond();
+        return start;
+    }
+
+    // Sleeps until the clock has passed second and returns the new second.
+    static int64_t waitForSecondAfter(int64_t second) {
+        int64_t now = currentSecond();
+        while (now <= second) {
+            std::this_thread::sleep_until(std::chrono::system_clock::time_point(std::chrono::seconds(second + 1)));
+            now = currentSecond();
+        }
+        return now;
+    }
+
+    static uint64_t splitmix64(uint64_t& x) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+
+    static uint64_t rotl(uint64_t x, int k) {
+        return (x << k) | (x >> (64 - k));
+    }
+
+    static State& state() {
+        thread_local State st = [] {
+            State init{};
+            std::random_device rd;
+            uint64_t seed = (static_cast<uint64_t>(rd()) << 32) ^ rd();
+            for (auto& word : init.s) {
+                word = splitmix64(seed);
+            }
+            init.slot = kNoSlot;
+            init.rrn_second = processStartSecond();
+            init.rrn_seq = kRrnPerSecond;
+            return init;
+        }();
+        return st;
+    }
+
+public:
+    static uint64_t next() {
+        uint64_t* s = state().s;
+        uint64_t result = rotl(s[1] * 5, 7) * 9;
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = rotl(s[3], 45);
+        return result;
+    }
+
+    static uint64_t uniform(uint64_t bound) {
+        return static_cast<uint64_t>((static_cast<unsigned __int128>(next()) * bound) >> 64);
+    }
+
+    static std::string nonce() {
+        static const char kHex[] = "0123456789ABCDEF";
+        uint64_t bits = next();
+        size_t length = 8 + uniform(9);
+        std::string result(length, '0');
+        for (size_t i = 0; i < length; i++) {
+            result[i] = kHex[bits & 0xF];
+            bits >>= 4;
+        }
+        return result;
+    }
+
+    static std::string authCode() {
+        char buffer[8];
+        char* end = std::to_chars(buffer, buffer + sizeof(buffer), 100000 + uniform(900000)).ptr;
+        return std::string(buffer, end);
+    }
+
+    static std::string rrn() {
+        State& st = state();
+        if (st.slot == kNoSlot) {
+            st.slot = slotCounter().fetch_add(1, std::memory_order_relaxed);
+            if (st.slot >= kRrnSlots) {
+                LOG_ERROR("More than {} threads generating RRNs; RRNs would no longer be unique", kRrnSlots);
+                Logger::instance().stopAsync();
+                std::abort();
+            }
+        }
+        int64_t now = currentSecond();
+        if (now <= st.rrn_second && st.rrn_seq >= kRrnPerSecond) {
+            now = waitForSecondAfter(st.rrn_second);
+        }
+        if (now > st.rrn_second) {
+            st.rrn_second = now;
+            st.rrn_seq = 0;
+        }
+        uint64_t value = static_cast<uint64_t>(st.rrn_second % 100000) * 10000000ULL +
+                         st.slot * static_cast<uint64_t>(kRrnPerSecond) + st.rrn_seq++;
+
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "%012llu", static_cast<unsigned long long>(value));
+        return std::string(buffer, 12);
+    }
+};
+
+std::string generateNonce() {
+    return IdGenerator::nonce();
+}
+
+std::string generateAuthCode() {
+    return IdGenerator::authCode();
+}
+
+std::string generateMaskedPAN() {
+    return "****-****-****-1234";
+}
+
+std::string generateRRN() {
+    return IdGenerator::rrn();
+}
+
+class LatencyModel {
+private:
+    enum class Kind {
+        Fixed,
+        Uniform,
+        LogNormal
+    };
+
+    Kind kind;
+    double a;
+    double b;
+
+public:
+    LatencyModel() : kind(Kind::Fixed), a(100), b(0) {}
+
+    // "fixed:<ms>", "uniform:<min_ms>:<max_ms>" or "lognormal:<median_ms>:<sigma>".
+    bool parse(const std::string& spec) {
+        std::vector<std::string> parts;
+        std::stringstream ss(spec);
+        std::string part;
+        while (std::getline(ss, part, ':')) {
+            parts.push_back(part);
+        }
+
+        try {
+            if (parts.size() == 2 && parts[0] == "fixed") {
+                kind = Kind::Fixed;
+                a = std::stod(parts[1]);
+                return a >= 0;
+            }
+            if (parts.size() == 3 && parts[0] == "uniform") {
+                kind = Kind::Uniform;
+                a = std::stod(parts[1]);
+                b = std::stod(parts[2]);
+                return a >= 0 && b >= a;
+            }
+            if (parts.size() == 3 && parts[0] == "lognormal") {
+                kind = Kind::LogNormal;
+                a = std::stod(parts[1]);
+                b = std::stod(parts[2]);
+                return a > 0 && b >= 0;
+            }
+        } catch (const std::exception&) {
+        }
+        return false;
+    }
+
+    std::chrono::microseconds sample() const {
+        double ms = a;
+        if (kind == Kind::Uniform) {
+            ms = a + (b - a) * unitInterval();
+        } else if (kind == Kind::LogNormal) {
+            double u1 = 1.0 - unitInterval();
+            double u2 = unitInterval();
+            double normal = std::sqrt(-2.0 * std::log(u1)) * std::cos(2.0 * M_PI * u2);
+            ms = a * std::exp(b * normal);
+        }
+        return std::chrono::microseconds(static_cast<int64_t>(ms * 1000.0));
+    }
+
+private:
+    static double unitInterval() {
+        return (IdGenerator::next() >> 11) * 0x1.0p-53;
+    }
+};
+
+enum class IoBackend {
+    Epoll,
+    Uring
+};
+
+struct ServerConfig {
+    int port = 0;
+    int workers = 1;
+    std::vector<int> cpus;
+    Durability durability = Durability::Commit;
+    size_t batch_size = 256;
+    int flush_interval_ms = 2;
+    LatencyModel latency;
+    int64_t replay_window = 300;
+    size_t replay_capacity = 65536;
+    int metrics_port = 0;
+    std::string trace_path;
+    std::string rules_path;
+    int backlog = 511;
+    double source_rate = 0;
+    double source_burst = 20;
+    size_t busy_backlog = 32768;
+    size_t max_pending = 256;
+    bool sharded_storage = false;
+    std::string journal_dir;
+    TransactionJournal::Sync journal_sync = TransactionJournal::Sync::Batch;
+    int journal_sync_interval_ms = 0;
+    size_t journal_segment_records = 32768;
+    IoBackend io_backend = IoBackend::Epoll;
+    std::string unix_path;
+};
+
+long getCurrentUnixTimestamp() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool setSocketTimeout(int socket, int timeout_ms) {
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        return false;
+    }
+    if (setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return false;
+    }
+    return true;
+}
+
+std::string_view stripCR(std::string_view str) {
+    if (!str.empty() && str.back() == '\r') {
+        str.remove_suffix(1);
+    }
+    return str;
+}
+
+template <typename T>
+T loadLE(const char* bytes) {
+    T value;
+    memcpy(&value, bytes, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if constexpr (sizeof(T) == 2) {
+        value = static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(value)));
+    } else if constexpr (sizeof(T) == 4) {
+        value = static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(value)));
+    } else {
+        value = static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(value)));
+    }
+#endif
+    return value;
+}
+
+template <typename T>
+void storeLE(char* bytes, T value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    if constexpr (sizeof(T) == 2) {
+        value = static_cast<T>(__builtin_bswap16(static_cast<uint16_t>(value)));
+    } else if constexpr (sizeof(T) == 4) {
+        value = static_cast<T>(__builtin_bswap32(static_cast<uint32_t>(value)));
+    } else {
+        value = static_cast<T>(__builtin_bswap64(static_cast<uint64_t>(value)));
+    }
+#endif
+    memcpy(bytes, &value, sizeof(value));
+}
+
+class RecvBuffer {
+private:
+    std::unique_ptr<char[]> data;
+    size_t capacity;
+    size_t head;
+    size_t tail;
+    size_t scanned;
+
+public:
+    explicit RecvBuffer(size_t capacity = 4096)
+        : data(new char[capacity]), capacity(capacity), head(0), tail(0), scanned(0) {}
+
+    // Reads once into the free space. Returns bytes read, 0 on EOF, -1 on
+    // error (errno set) and -2 when a single frame exceeds the capacity.
+    ssize_t fill(int socket) {
+        if (tail == capacity) {
+            if (head == 0) {
+                return -2;
+            }
+            compact();
+        }
+
+        while (true) {
+            ssize_t n = recv(socket, data.get() + tail, capacity - tail, 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n > 0) {
+                tail += n;
+            }
+            return n;
+        }
+    }
+
+    // Copies as much of bytes as fits and returns how many were taken; 0
+    // means a single frame exceeds the capacity.
+    size_t append(const char* bytes, size_t size) {
+        if (tail == capacity && head > 0) {
+            compact();
+        }
+        size_t taken = std::min(size, capacity - tail);
+        memcpy(data.get() + tail, bytes, taken);
+        tail += taken;
+        return taken;
+    }
+
+    // Hands out the next complete line without its terminator. The view
+    // stays valid until the next fill() or clear().
+    bool nextLine(std::string_view& line) {
+        const char* begin = data.get() + head;
+        const char* newline = static_cast<const char*>(
+            memchr(data.get() + scanned, '\n', tail - scanned));
+        if (!newline) {
+            scanned = tail;
+            return false;
+        }
+
+        line = stripCR(std::string_view(begin, newline - begin));
+        head = newline - data.get() + 1;
+        scanned = head;
+        if (head == tail) {
+            head = tail = scanned = 0;
+        }
+        return true;
+    }
+
+    // Hands out the next complete length-prefixed frame (see FrameType),
+    // header included, as a view into the buffer; valid until the next
+    // fill(), append() or clear(). An empty frame means the length prefix
+    // is corrupt and the stream cannot be resynchronised.
+    bool nextFrame(std::string_view& frame, size_t max_size) {
+        size_t available = tail - head;
+        if (available < 2) {
+            return false;
+        }
+        uint16_t length = loadLE<uint16_t>(data.get() + head);
+        if (length < 8 || length > max_size || length > capacity) {
+            frame = std::string_view();
+            return true;
+        }
+        if (available < length) {
+            return false;
+        }
+        frame = std::string_view(data.get() + head, length);
+        head += length;
+        scanned = head;
+        if (head == tail) {
+            head = tail = scanned = 0;
+        }
+        return true;
+    }
+
+    std::string_view takeRemaining() {
+        std::string_view rest = stripCR(std::string_view(data.get() + head, tail - head));
+        head = tail = scanned = 0;
+        return rest;
+    }
+
+    bool empty() const {
+        return head == tail;
+    }
+
+    void clear() {
+        head = tail = scanned = 0;
+    }
+
+private:
+    void compact() {
+        size_t pending = tail - head;
+        memmove(data.get(), data.get() + head, pending);
+        scanned -= head;
+        head = 0;
+        tail = pending;
+    }
+};
+
+struct AuthRequest {
+    Money amount;
+    int64_t unix_ts;
+    uint8_t nonce_len;
+    char nonce[17];
+
+    std::string_view nonceView() const {
+        return std::string_view(nonce, nonce_len);
+    }
+};
+
+enum class AuthParseError {
+    None,
+    Format,
+    AmountOrTimestamp,
+    NonceLength,
+    NonceFormat
+};
+
+const char* authParseErrorReason(AuthParseError error) {
+    switch (error) {
+        case AuthParseError::Format:
+            return "Invalid AUTH format";
+        case AuthParseError::AmountOrTimestamp:
+            return "Invalid amount or timestamp format";
+        case AuthParseError::NonceLength:
+            return "Invalid nonce length";
+        case AuthParseError::NonceFormat:
+            return "Invalid nonce format";
+        case AuthParseError::None:
+            break;
+    }
+    return "";
+}
+
+// Single pass over "AUTH|<amount>|<unix_ts>|<nonce>" without allocating.
+AuthParseError parseAuthRequest(std::string_view line, AuthRequest& request) {
+    std::string_view fields[4];
+    size_t count = 0;
+    size_t start = 0;
+    while (true) {
+        size_t bar = line.find('|', start);
+        if (count == 4) {
+            return AuthParseError::Format;
+        }
+        if (bar == std::string_view::npos) {
+            fields[count++] = line.substr(start);
+            break;
+        }
+        fields[count++] = line.substr(start, bar - start);
+        start = bar + 1;
+    }
+
+    if (count != 4 || fields[0] != "AUTH") {
+        return AuthParseError::Format;
+    }
+
+    if (!Money::parse(fields[1], request.amount)) {
+        return AuthParseError::AmountOrTimestamp;
+    }
+
+    std::string_view ts = fields[2];
+    if (ts.empty() || !(isDigit(ts.front()) || ts.front() == '-')) {
+        return AuthParseError::AmountOrTimestamp;
+    }
+    auto result = std::from_chars(ts.data(), ts.data() + ts.size(), request.unix_ts);
+    if (result.ec != std::errc() || result.ptr != ts.data() + ts.size()) {
+        return AuthParseError::AmountOrTimestamp;
+    }
+
+    std::string_view nonce = fields[3];
+    if (nonce.size() < 8 || nonce.size() > 16) {
+        return AuthParseError::NonceLength;
+    }
+    for (char c : nonce) {
+        if (!isHexDigit(c)) {
+            return AuthParseError::NonceFormat;
+        }
+    }
+    memcpy(request.nonce, nonce.data(), nonce.size());
+    request.nonce[nonce.size()] = '\0';
+    request.nonce_len = static_cast<uint8_t>(nonce.size());
+
+    return AuthParseError::None;
+}
+
+// Best-effort nonce of a malformed AUTH line (its last field), so pipelined
+// clients can still match the error reply to their request.
+std::string_view authCorrelationTag(std::string_view line) {
+    size_t bar = line.rfind('|');
+    if (bar == std::string_view::npos) {
+        return {};
+    }
+    std::string_view tag = line.substr(bar + 1);
+    return tag.size() <= 32 ? tag : std::string_view();
+}
+
+// OPI-Lite 2.0, negotiated with "HELLO|GW|2.0" / "HELLO|TERM|2.0": after
+// the text handshake both directions carry length-prefixed binary frames.
+// All integers are little-endian. Every frame starts with an 8-byte
+// header - u16 total length, u8 type, u8 code (replies) or nonce length
+// (AUTH), u32 request id - and the request id comes back on the reply,
+// which, as with 1.1, may arrive out of order.
+//   AUTH (48 bytes):  header, i64 amount_minor @8, i64 unix_ts @16,
+//                     char currency[4] @24 (zero: USD), u32 reserved @28,
+//                     char nonce[16] @32 (ASCII hex, nonce length used)
+//   PING (8 bytes):   header only; answered by PONG
+//   AUTH reply:       header with a ReplyCode; Approved is followed by
+//                     auth_code[8], masked_pan[24] and rrn[16] (zero padded),
+//                     any other code by the reason text
+enum class FrameType : uint8_t {
+    Auth = 0x01,
+    Ping = 0x02,
+    AuthReply = 0x81,
+    Pong = 0x82
+};
+
+enum class ReplyCode : uint8_t {
+    Approved = 0,
+    Declined = 1,
+    InvalidRequest = 2,
+    StaleTimestamp = 3,
+    DuplicateInProgress = 4,
+    NonceReused = 5,
+    RateLimited = 6,
+    Busy = 7,
+    DatabaseError = 8,
+    DatabaseBusy = 9,
+    // Never sent as a code: marks the reply to a PING.
+    Pong = 0xFF
+};
+
+constexpr size_t kFrameHeaderSize = 8;
+constexpr size_t kAuthFrameSize = 48;
+constexpr size_t kApprovedReplySize = kFrameHeaderSize + 8 + 24 + 16;
+constexpr size_t kMaxFrameSize = 512;
+// Longest decline reason a rules file may give, so that the reason with
+// an amount substituted always fits a reply frame.
+constexpr size_t kMaxDeclineReason = 200;
+
+// A reply as decided, before it is put on the wire: text sessions get
+// text() ("APPROVED|a|p|r", "DECLINED|why" or "PONG"), 2.0 sessions the
+// frame from appendReplyFrame(), each built from these fields.
+struct Reply {
+    ReplyCode code;
+    // Approved only; zero padded, as in the 2.0 AUTH reply body.
+    char auth_code[8];
+    char masked_pan[24];
+    char rrn[16];
+    // Any other code but Pong: the text after "DECLINED|".
+    std::string reason;
+
+    static Reply approved(std::string_view auth_code, std::string_view masked_pan, std::string_view rrn) {
+        Reply reply{ReplyCode::Approved, {}, {}, {}, {}};
+        copyField(reply.auth_code, auth_code);
+        copyField(reply.masked_pan, masked_pan);
+        copyField(reply.rrn, rrn);
+        return reply;
+    }
+
+    static Reply declined(ReplyCode code, std::string reason) {
+        return {code, {}, {}, {}, std::move(reason)};
+    }
+
+    static Reply pong() {
+        return {ReplyCode::Pong, {}, {}, {}, {}};
+    }
+
+    std::string text() const {
+        switch (code) {
+            case ReplyCode::Approved:
+                return std::string("APPROVED|") + auth_code + "|" + masked_pan + "|" + rrn;
+            case ReplyCode::Pong:
+                return "PONG";
+            default:
+                return "DECLINED|" + reason;
+        }
+    }
+};
+
+inline FrameType frameType(std::string_view frame) {
+    return static_cast<FrameType>(frame[2]);
+}
+
+// The request id bytes, used as the reply's correlation tag as they are.
+inline std::string_view frameTag(std::string_view frame) {
+    return frame.substr(4, 4);
+}
+
+void writeFrameHeader(char* frame, size_t length, FrameType type, uint8_t code, std::string_view tag) {
+    storeLE<uint16_t>(frame, static_cast<uint16_t>(length));
+    frame[2] = static_cast<char>(type);
+    frame[3] = static_cast<char>(code);
+    memset(frame + 4, 0, 4);
+    memcpy(frame + 4, tag.data(), std::min<size_t>(tag.size(), 4));
+}
+
+// Reads the fields straight out of the receive buffer; the frame itself
+// is never copied.
+AuthParseError decodeAuthFrame(std::string_view frame, AuthRequest& request) {
+    if (frame.size() != kAuthFrameSize) {
+        return AuthParseError::Format;
+    }
+    const char* bytes = frame.data();
+    int64_t minor = loadLE<int64_t>(bytes + 8);
+    if (minor < 0) {
+        return AuthParseError::AmountOrTimestamp;
+    }
+    std::string_view currency(bytes + 24, strnlen(bytes + 24, 4));
+    if (currency.empty()) {
+        currency = "USD";
+    } else if (currency.size() != 3 || !std::all_of(currency.begin(), currency.end(),
+                                                    [](char c) { return c >= 'A' && c <= 'Z'; })) {
+        return AuthParseError::AmountOrTimestamp;
+    }
+    request.amount = Money::fromMinor(minor, currency);
+    request.unix_ts = loadLE<int64_t>(bytes + 16);
+
+    uint8_t nonce_len = static_cast<uint8_t>(bytes[3]);
+    if (nonce_len < 8 || nonce_len > 16) {
+        return AuthParseError::NonceLength;
+    }
+    const char* nonce = bytes + 32;
+    for (uint8_t i = 0; i < nonce_len; i++) {
+        if (!isHexDigit(nonce[i])) {
+            return AuthParseError::NonceFormat;
+        }
+    }
+    memcpy(request.nonce, nonce, nonce_len);
+    request.nonce[nonce_len] = '\0';
+    request.nonce_len = nonce_len;
+    return AuthParseError::None;
+}
+
+void appendAuthFrame(std::string& out, uint32_t request_id, const Money& amount, int64_t unix_ts,
+                     std::string_view nonce) {
+    char frame[kAuthFrameSize] = {};
+    char tag[4];
+    storeLE<uint32_t>(tag, request_id);
+    size_t nonce_len = std::min<size_t>(nonce.size(), 16);
+    writeFrameHeader(frame, kAuthFrameSize, FrameType::Auth, static_cast<uint8_t>(nonce_len),
+                     std::string_view(tag, 4));
+    storeLE<int64_t>(frame + 8, amount.minor);
+    storeLE<int64_t>(frame + 16, unix_ts);
+    memcpy(frame + 24, amount.currency, std::min<size_t>(amount.currencyCode().size(), 4));
+    memcpy(frame + 32, nonce.data(), nonce_len);
+    out.append(frame, sizeof(frame));
+}
+
+void appendPingFrame(std::string& out, uint32_t request_id) {
+    char frame[kFrameHeaderSize];
+    char tag[4];
+    storeLE<uint32_t>(tag, request_id);
+    writeFrameHeader(frame, sizeof(frame), FrameType::Ping, 0, std::string_view(tag, 4));
+    out.append(frame, sizeof(frame));
+}
+
+void appendReplyFrame(std::string& out, const Reply& reply, std::string_view tag) {
+    char frame[kMaxFrameSize] = {};
+    if (reply.code == ReplyCode::Pong) {
+        writeFrameHeader(frame, kFrameHeaderSize, FrameType::Pong, 0, tag);
+        out.append(frame, kFrameHeaderSize);
+        return;
+    }
+
+    if (reply.code == ReplyCode::Approved) {
+        memcpy(frame + kFrameHeaderSize, reply.auth_code, sizeof(reply.auth_code));
+        memcpy(frame + kFrameHeaderSize + 8, reply.masked_pan, sizeof(reply.masked_pan));
+        memcpy(frame + kFrameHeaderSize + 32, reply.rrn, sizeof(reply.rrn));
+        writeFrameHeader(frame, kApprovedReplySize, FrameType::AuthReply, static_cast<uint8_t>(ReplyCode::Approved),
+                         tag);
+        out.append(frame, kApprovedReplySize);
+        return;
+    }
+
+    size_t length = kFrameHeaderSize + std::min(reply.reason.size(), kMaxFrameSize - kFrameHeaderSize);
+    memcpy(frame + kFrameHeaderSize, reply.reason.data(), length - kFrameHeaderSize);
+    writeFrameHeader(frame, length, FrameType::AuthReply, static_cast<uint8_t>(reply.code), tag);
+    out.append(frame, length);
+}
+
+// The text-protocol form of a 2.0 reply frame, for display.
+std::string replyFrameText(std::string_view frame) {
+    if (frameType(frame) == FrameType::Pong) {
+        return "PONG";
+    }
+    std::string_view body = frame.substr(kFrameHeaderSize);
+    if (static_cast<ReplyCode>(frame[3]) == ReplyCode::Approved && body.size() >= 48) {
+        auto field = [&](size_t offset, size_t width) {
+            return std::string(body.data() + offset, strnlen(body.data() + offset, width));
+        };
+        return "APPROVED|" + field(0, 8) + "|" + field(8, 24) + "|" + field(32, 16);
+    }
+    return "DECLINED|" + std::string(body);
+}
+
+enum class ReplayStatus {
+    New,
+    Duplicate,
+    InProgress,
+    Replayed,
+    Full
+};
+
+// Remembers the reply to every AUTH nonce for as long as its unix_ts can
+// still pass the skew check, so a retried request gets the original answer
+// instead of a second transaction. Sharded open-addressing tables with
+// linear probing; an entry is one 128-byte, cache-line aligned slot.
+class ReplayCache {
+public:
+    struct alignas(64) Entry {
+        uint64_t nonce_bits;
+        int64_t unix_ts;
+        uint8_t nonce_len;
+        uint8_t state;
+        uint8_t response_len;
+        ReplyCode code;
+        // An approval's three fields back to back, or the decline reason.
+        char response[128 - 20];
+    };
+
+private:
+    enum : uint8_t {
+        kEmpty = 0,
+        kPending = 1,
+        kDone = 2
+    };
+
+    static constexpr size_t kShards = 64;
+
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        std::unique_ptr<Entry[]> entries;
+        size_t used = 0;
+        int64_t last_purge = 0;
+    };
+
+    std::unique_ptr<Shard[]> shards;
+    size_t shard_mask;
+    int64_t window;
+
+public:
+    ReplayCache(size_t capacity, int64_t window_seconds) : shards(new Shard[kShards]), window(window_seconds) {
+        size_t per_shard = 16;
+        while (per_shard * kShards < capacity) {
+            per_shard <<= 1;
+        }
+        shard_mask = per_shard - 1;
+        for (size_t i = 0; i < kShards; i++) {
+            shards[i].entries.reset(new Entry[per_shard]());
+        }
+    }
+
+    int64_t windowSeconds() const {
+        return window;
+    }
+
+    bool isStale(int64_t unix_ts, int64_t now) const {
+        return unix_ts < now - window || unix_ts > now + window;
+    }
+
+    // On Duplicate, cached holds the reply recorded by finish().
+    ReplayStatus begin(std::string_view nonce, int64_t unix_ts, int64_t now, Reply& cached) {
+        uint64_t bits = nonceBits(nonce);
+        uint64_t hash = mix(bits ^ (static_cast<uint64_t>(nonce.size()) << 56));
+        Shard& shard = shards[hash % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        Entry* free_slot = nullptr;
+        size_t probes = 0;
+        for (size_t i = (hash >> 8) & shard_mask; probes <= shard_mask; i = (i + 1) & shard_mask, probes++) {
+            Entry& entry = shard.entries[i];
+            if (entry.state == kEmpty) {
+                if (!free_slot) {
+                    free_slot = &entry;
+                }
+                break;
+            }
+            if (expired(entry, now)) {
+                if (!free_slot) {
+                    free_slot = &entry;
+                }
+                continue;
+            }
+            if (entry.nonce_bits == bits && entry.nonce_len == nonce.size()) {
+                if (entry.unix_ts != unix_ts) {
+                    return ReplayStatus::Replayed;
+                }
+                if (entry.state == kPending) {
+                    return ReplayStatus::InProgress;
+                }
+                cached = storedReply(entry);
+                return ReplayStatus::Duplicate;
+            }
+        }
+
+        if (!free_slot || (free_slot->state == kEmpty && shard.used * 4 >= (shard_mask + 1) * 3)) {
+            if (shard.last_purge == now) {
+                return ReplayStatus::Full;
+            }
+            purge(shard, now);
+            if (shard.used * 4 >= (shard_mask + 1) * 3) {
+                return ReplayStatus::Full;
+            }
+            free_slot = findFree(shard, hash);
+        }
+
+        if (free_slot->state == kEmpty) {
+            shard.used++;
+        }
+        free_slot->nonce_bits = bits;
+        free_slot->nonce_len = static_cast<uint8_t>(nonce.size());
+        free_slot->unix_ts = unix_ts;
+        free_slot->state = kPending;
+        free_slot->response_len = 0;
+        return ReplayStatus::New;
+    }
+
+    // Forgets a nonce claimed by begin() whose outcome was transient (the
+    // record never reached storage), so a retry is processed afresh.
+    void release(std::string_view nonce, int64_t unix_ts) {
+        uint64_t bits = nonceBits(nonce);
+        uint64_t hash = mix(bits ^ (static_cast<uint64_t>(nonce.size()) << 56));
+        Shard& shard = shards[hash % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        size_t probes = 0;
+        for (size_t i = (hash >> 8) & shard_mask; probes <= shard_mask; i = (i + 1) & shard_mask, probes++) {
+            Entry& entry = shard.entries[i];
+            if (entry.state == kEmpty) {
+                return;
+            }
+            if (entry.nonce_bits == bits && entry.nonce_len == nonce.size() && entry.unix_ts == unix_ts) {
+                // Expired rather than empty, so probe chains stay intact.
+                entry.unix_ts = INT64_MIN / 2;
+                entry.state = kDone;
+                return;
+            }
+        }
+    }
+
+    // Records (or corrects) the reply sent for a nonce claimed by begin().
+    void finish(std::string_view nonce, int64_t unix_ts, const Reply& reply) {
+        uint64_t bits = nonceBits(nonce);
+        uint64_t hash = mix(bits ^ (static_cast<uint64_t>(nonce.size()) << 56));
+        Shard& shard = shards[hash % kShards];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+
+        size_t probes = 0;
+        for (size_t i = (hash >> 8) & shard_mask; probes <= shard_mask; i = (i + 1) & shard_mask, probes++) {
+            Entry& entry = shard.entries[i];
+            if (entry.state == kEmpty) {
+                return;
+            }
+            if (entry.nonce_bits == bits && entry.nonce_len == nonce.size() && entry.unix_ts == unix_ts) {
+                if (reply.code == ReplyCode::Approved) {
+                    memcpy(entry.response, reply.auth_code, sizeof(reply.auth_code));
+                    memcpy(entry.response + 8, reply.masked_pan, sizeof(reply.masked_pan));
+                    memcpy(entry.response + 32, reply.rrn, sizeof(reply.rrn));
+                    entry.response_len = 48;
+                } else if (reply.reason.size() <= sizeof(entry.response)) {
+                    memcpy(entry.response, reply.reason.data(), reply.reason.size());
+                    entry.response_len = static_cast<uint8_t>(reply.reason.size());
+                } else {
+                    entry.unix_ts = INT64_MIN / 2;
+                    entry.state = kDone;
+                    return;
+                }
+                entry.code = reply.code;
+                entry.state = kDone;
+                return;
+            }
+        }
+    }
+
+    size_t capacity() const {
+        return (shard_mask + 1) * kShards;
+    }
+
+private:
+    static Reply storedReply(const Entry& entry) {
+        if (entry.code == ReplyCode::Approved) {
+            return Reply::approved(std::string_view(entry.response, strnlen(entry.response, 8)),
+                                   std::string_view(entry.response + 8, strnlen(entry.response + 8, 24)),
+                                   std::string_view(entry.response + 32, strnlen(entry.response + 32, 16)));
+        }
+        return Reply::declined(entry.code, std::string(entry.response, entry.response_len));
+    }
+
+    bool expired(const Entry& entry, int64_t now) const {
+        return entry.unix_ts + window < now;
+    }
+
+    static uint64_t nonceBits(std::string_view nonce) {
+        uint64_t bits = 0;
+        for (char c : nonce) {
+            uint64_t nibble = c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10;
+            bits = (bits << 4) | (nibble & 0xF);
+        }
+        return bits;
+    }
+
+    static uint64_t mix(uint64_t x) {
+        x ^= x >> 33;
+        x *= 0xFF51AFD7ED558CCDULL;
+        x ^= x >> 33;
+        x *= 0xC4CEB9FE1A85EC53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    Entry* findFree(Shard& shard, uint64_t hash) {
+        for (size_t i = (hash >> 8) & shard_mask;; i = (i + 1) & shard_mask) {
+            if (shard.entries[i].state == kEmpty) {
+                return &shard.entries[i];
+            }
+        }
+    }
+
+    // Rebuilds the shard without expired entries so probe chains stay short.
+    void purge(Shard& shard, int64_t now) {
+        shard.last_purge = now;
+        size_t size = shard_mask + 1;
+        std::unique_ptr<Entry[]> old(new Entry[size]());
+        old.swap(shard.entries);
+        shard.used = 0;
+        for (size_t i = 0; i < size; i++) {
+            const Entry& entry = old[i];
+            if (entry.state == kEmpty || expired(entry, now)) {
+                continue;
+            }
+            uint64_t hash = mix(entry.nonce_bits ^ (static_cast<uint64_t>(entry.nonce_len) << 56));
+            *findFree(shard, hash) = entry;
+            shard.used++;
+        }
+    }
+};
+
+// Per-source-IP token buckets in a fixed-size table split into shards of
+// 64 slots. A slot is claimed for an address with a CAS on its key and its
+// bucket is updated with a CAS on one packed word (tokens in thousandths,
+// last refill in ms), so admission never locks. A slot whose bucket has
+// been idle long enough to refill completely is as good as empty and is
+// taken over when a shard runs out of free slots; if none can be claimed
+// the request is admitted.
+class SourceRateLimiter {
+private:
+    static constexpr size_t kShardSlots = 64;
+
+    struct Slot {
+        std::atomic<uint32_t> key{0};
+        std::atomic<uint64_t> state{0};
+    };
+
+    double rate;
+    uint64_t burst_milli;
+    uint32_t refill_ms;
+    size_t shard_count;
+    std::unique_ptr<Slot[]> slots;
+    std::chrono::steady_clock::time_point epoch;
+
+public:
+    // rate is tokens (requests) per second; 0 disables the limiter.
+    SourceRateLimiter(double rate, double burst, size_t capacity)
+        : rate(rate), burst_milli(static_cast<uint64_t>(std::max(burst, 1.0) * 1000)),
+          refill_ms(rate > 0 ? static_cast<uint32_t>(std::ceil(std::max(burst, 1.0) / rate * 1000)) : 0),
+          shard_count(std::max<size_t>(capacity / kShardSlots, 1)),
+          slots(new Slot[shard_count * kShardSlots]), epoch(std::chrono::steady_clock::now()) {}
+
+    bool enabled() const {
+        return rate > 0;
+    }
+
+    bool admit(uint32_t ip) {
+        if (!enabled()) {
+            return true;
+        }
+        uint32_t now_ms = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - epoch).count());
+        Slot* slot = find(ip, now_ms);
+        if (!slot) {
+            return true;
+        }
+
+        uint64_t current = slot->state.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t tokens = current >> 32;
+            uint32_t last_ms = static_cast<uint32_t>(current);
+            uint32_t elapsed = now_ms - last_ms;
+            if (current == 0 || elapsed >= refill_ms) {
+                tokens = burst_milli;
+            } else {
+                tokens = std::min<uint64_t>(burst_milli, tokens + static_cast<uint64_t>(elapsed * rate));
+            }
+            if (tokens < 1000) {
+                return false;
+            }
+            uint64_t next = ((tokens - 1000) << 32) | now_ms;
+            if (slot->state.compare_exchange_weak(current, next, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+private:
+    Slot* find(uint32_t ip, uint32_t now_ms) {
+        uint32_t key = ip + 1;
+        if (key == 0) {
+            key = 1;
+        }
+        uint64_t hash = key * 0x9E3779B97F4A7C15ull;
+        Slot* shard = &slots[(hash >> 32) % shard_count * kShardSlots];
+        size_t start = hash % kShardSlots;
+
+        for (size_t i = 0; i < kShardSlots; i++) {
+            Slot& slot = shard[(start + i) % kShardSlots];
+            uint32_t owner = slot.key.load(std::memory_order_acquire);
+            if (owner == key) {
+                return &slot;
+            }
+            if (owner == 0) {
+                if (slot.key.compare_exchange_strong(owner, key, std::memory_order_acq_rel) || owner == key) {
+                    return &slot;
+                }
+            }
+        }
+
+        for (size_t i = 0; i < kShardSlots; i++) {
+            Slot& slot = shard[(start + i) % kShardSlots];
+            uint64_t state = slot.state.load(std::memory_order_relaxed);
+            if (now_ms - static_cast<uint32_t>(state) < refill_ms) {
+                continue;
+            }
+            uint32_t owner = slot.key.load(std::memory_order_acquire);
+            if (owner != key && slot.key.compare_exchange_strong(owner, key, std::memory_order_acq_rel)) {
+                slot.state.store(0, std::memory_order_relaxed);
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+};
+
+// Built-in rules, used when no --rules file is given: the historical
+// $50.50 limit.
+constexpr const char* kDefaultRules =
+    "rule name=limit min=50.50 decline=\"Amount ${amount} exceeds limit ($50.50)\"\n"
+    "default approve\n";
+
+struct RuleContext {
+    uint32_t terminal_ip;
+    Money amount;
+    int64_t unix_ts;
+};
+
+// An authorization rule set compiled from the rules file into a flat array
+// that is walked front to back; the first rule whose conditions all hold
+// decides. Evaluation does not allocate. Velocity windows are fixed-size
+// atomic slots hashed by (rule, terminal); colliding terminals share a
+// count, which can only make a velocity rule stricter.
+//
+// File format, one directive per line ('#' starts a comment):
+//   terminal <ipv4> merchant <name>
+//   rule name=<name> [terminal=<ipv4>] [merchant=<name>] [hours=HH:MM-HH:MM]
+//        [min=<amount>] [max=<amount>] [currency=<ISO 4217>]
+//        [velocity=<count>/<seconds>] approve | decline="<reason>"
+//   default approve | decline="<reason>"
+// min is inclusive and max exclusive, in the rule's currency (USD unless
+// given); they only hold for requests in that currency. A request in a
+// currency none of the min/max rules is written in is declined before
+// any rule runs, so it can never slip past a limit. Hours are UTC of the
+// request's unix_ts and may wrap past midnight; a velocity rule matches
+// once more than <count> requests from the terminal reached it within the
+// window.
+// "{amount}" in a reason is replaced by the request amount, e.g.
+// decline="Amount ${amount} exceeds limit" gives "Amount $60.00 exceeds limit".
+class RuleSet {
+public:
+    struct Decision {
+        bool approved;
+        uint16_t rule;
+    };
+
+    // Decision::rule of a request declined for its currency.
+    static constexpr uint16_t kUnsupportedCurrency = UINT16_MAX;
+
+private:
+    enum : uint32_t {
+        kMatchTerminal = 1 << 0,
+        kMatchMerchant = 1 << 1,
+        kMatchHours = 1 << 2,
+        kMatchMin = 1 << 3,
+        kMatchMax = 1 << 4,
+        kMatchVelocity = 1 << 5
+    };
+
+    static constexpr size_t kVelocitySlots = 4096;
+
+    struct CompiledRule {
+        uint32_t conditions;
+        uint32_t terminal_ip;
+        uint32_t merchant;
+        uint32_t velocity_limit;
+        int64_t min_minor;
+        int64_t max_minor;
+        uint32_t velocity_window_s;
+        uint16_t from_minute;
+        uint16_t to_minute;
+        char currency[4];
+        bool approve;
+    };
+
+    struct Reason {
+        std::string prefix;
+        std::string suffix;
+        bool has_amount;
+    };
+
+    std::vector<CompiledRule> rules;
+    std::vector<Reason> reasons;
+    std::vector<std::string> names;
+    std::vector<std::pair<uint32_t, uint32_t>> terminal_merchants;
+    // The currencies of rules with min/max; empty if no rule limits amounts.
+    std::vector<std::string> amount_currencies;
+    std::unique_ptr<std::atomic<uint64_t>[]> velocity;
+
+public:
+    RuleSet() : velocity(new std::atomic<uint64_t>[kVelocitySlots]) {
+        for (size_t i = 0; i < kVelocitySlots; i++) {
+            velocity[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    size_t size() const {
+        return rules.size();
+    }
+
+    // On failure error describes the first bad line and the set is unusable.
+    bool compile(std::istream& in, std::string& error) {
+        std::vector<std::pair<std::string, uint32_t>> merchant_ids;
+        auto merchantId = [&](const std::string& name) {
+            for (const auto& entry : merchant_ids) {
+                if (entry.first == name) {
+                    return entry.second;
+                }
+            }
+            merchant_ids.emplace_back(name, static_cast<uint32_t>(merchant_ids.size() + 1));
+            return merchant_ids.back().second;
+        };
+
+        bool has_default = false;
+        std::string line;
+        for (int line_no = 1; std::getline(in, line); line_no++) {
+            std::vector<std::string> tokens;
+            if (!tokenize(line, tokens)) {
+                error = "line " + std::to_string(line_no) + ": unterminated quote";
+                return false;
+            }
+            if (tokens.empty()) {
+                continue;
+            }
+
+            auto fail = [&](const std::string& what) {
+                error = "line " + std::to_string(line_no) + ": " + what;
+                return false;
+            };
+
+            if (tokens[0] == "terminal") {
+                uint32_t ip;
+                if (tokens.size() != 4 || tokens[2] != "merchant" || !parseIp(tokens[1], ip)) {
+                    return fail("expected 'terminal <ipv4> merchant <name>'");
+                }
+                terminal_merchants.emplace_back(ip, merchantId(tokens[3]));
+                continue;
+            }
+
+            if (tokens[0] != "rule" && tokens[0] != "default") {
+                return fail("unknown directive '" + tokens[0] + "'");
+            }
+            if (has_default) {
+                return fail("rules after 'default' can never match");
+            }
+
+            CompiledRule rule{};
+            copyField(rule.currency, "USD");
+            std::string name = tokens[0] == "default" ? "default" : "";
+            std::string reason;
+            bool has_action = false;
+            for (size_t i = 1; i < tokens.size(); i++) {
+                const std::string& token = tokens[i];
+                size_t eq = token.find('=');
+                std::string key = token.substr(0, eq);
+                std::string value = eq == std::string::npos ? "" : token.substr(eq + 1);
+                bool is_default = tokens[0] == "default";
+
+                if (key == "approve" && eq == std::string::npos) {
+                    rule.approve = true;
+                    has_action = true;
+                } else if (key == "decline" && eq != std::string::npos) {
+                    rule.approve = false;
+                    has_action = true;
+                    reason = value;
+                    if (reason.size() > kMaxDeclineReason) {
+                        return fail("decline reason longer than " + std::to_string(kMaxDeclineReason) + " bytes");
+                    }
+                } else if (is_default) {
+                    return fail("'default' only takes approve or decline=\"<reason>\"");
+                } else if (key == "name") {
+                    name = value;
+                } else if (key == "terminal") {
+                    if (!parseIp(value, rule.terminal_ip)) {
+                        return fail("bad terminal address '" + value + "'");
+                    }
+                    rule.conditions |= kMatchTerminal;
+                } else if (key == "merchant") {
+                    rule.merchant = merchantId(value);
+                    rule.conditions |= kMatchMerchant;
+                } else if (key == "hours") {
+                    if (!parseHours(value, rule.from_minute, rule.to_minute)) {
+                        return fail("bad hours '" + value + "', expected HH:MM-HH:MM");
+                    }
+                    rule.conditions |= kMatchHours;
+                } else if (key == "min") {
+                    if (!parseAmountMinor(value, rule.min_minor)) {
+                        return fail("bad amount '" + value + "'");
+                    }
+                    rule.conditions |= kMatchMin;
+                } else if (key == "max") {
+                    if (!parseAmountMinor(value, rule.max_minor)) {
+                        return fail("bad amount '" + value + "'");
+                    }
+                    rule.conditions |= kMatchMax;
+                } else if (key == "currency") {
+                    if (value.size() != 3 || !std::all_of(value.begin(), value.end(),
+                                                          [](char c) { return c >= 'A' && c <= 'Z'; })) {
+                        return fail("bad currency '" + value + "', expected a 3-letter ISO 4217 code");
+                    }
+                    copyField(rule.currency, value);
+                } else if (key == "velocity") {
+                    if (!parseVelocity(value, rule.velocity_limit, rule.velocity_window_s)) {
+                        return fail("bad velocity '" + value + "', expected <count>/<seconds>");
+                    }
+                    rule.conditions |= kMatchVelocity;
+                } else {
+                    return fail("unknown rule field '" + key + "'");
+                }
+            }
+
+            if (!has_action) {
+                return fail("rule needs approve or decline=\"<reason>\"");
+            }
+            addReason(rule.approve ? "" : reason);
+            if (name.empty()) {
+                name = "rule" + std::to_string(rules.size() + 1);
+            }
+            names.push_back(name);
+            if ((rule.conditions & (kMatchMin | kMatchMax)) &&
+                std::find(amount_currencies.begin(), amount_currencies.end(), rule.currency) ==
+                    amount_currencies.end()) {
+                amount_currencies.emplace_back(rule.currency);
+            }
+            rules.push_back(rule);
+            has_default = tokens[0] == "default";
+        }
+
+        if (!has_default) {
+            error = "missing 'default approve' or 'default decline=\"<reason>\"'";
+            return false;
+        }
+        if (rules.size() >= kUnsupportedCurrency) {
+            error = "too many rules";
+            return false;
+        }
+
+        for (auto& rule : rules) {
+            if ((rule.conditions & kMatchMerchant) == 0) {
+                continue;
+            }
+            bool mapped = false;
+            for (const auto& entry : terminal_merchants) {
+                mapped = mapped || entry.second == rule.merchant;
+            }
+            if (!mapped) {
+                error = "a rule names a merchant with no terminal mapped to it";
+                return false;
+            }
+        }
+
+        std::sort(terminal_merchants.begin(), terminal_merchants.end());
+        return true;
+    }
+
+    Decision evaluate(const RuleContext& ctx) const {
+        std::string_view currency = ctx.amount.currencyCode();
+        if (!amount_currencies.empty() &&
+            std::find(amount_currencies.begin(), amount_currencies.end(), currency) == amount_currencies.end()) {
+            return {false, kUnsupportedCurrency};
+        }
+        uint32_t merchant = merchantOf(ctx.terminal_ip);
+        uint16_t minute = static_cast<uint16_t>(((ctx.unix_ts % 86400) + 86400) % 86400 / 60);
+
+        for (size_t i = 0; i < rules.size(); i++) {
+            const CompiledRule& rule = rules[i];
+            uint32_t c = rule.conditions;
+            if ((c & kMatchTerminal) && ctx.terminal_ip != rule.terminal_ip) {
+                continue;
+            }
+            if ((c & kMatchMerchant) && merchant != rule.merchant) {
+                continue;
+            }
+            if ((c & (kMatchMin | kMatchMax)) && currency != rule.currency) {
+                continue;
+            }
+            if ((c & kMatchMin) && ctx.amount.minor < rule.min_minor) {
+                continue;
+            }
+            if ((c & kMatchMax) && ctx.amount.minor >= rule.max_minor) {
+                continue;
+            }
+            if ((c & kMatchHours) && !inWindow(minute, rule.from_minute, rule.to_minute)) {
+                continue;
+            }
+            if ((c & kMatchVelocity) && !overVelocity(i, rule, ctx)) {
+                continue;
+            }
+            return {rule.approve, static_cast<uint16_t>(i)};
+        }
+        return {true, 0};
+    }
+
+    const std::string& ruleName(uint16_t rule) const {
+        static const std::string currency_check = "currency";
+        return rule == kUnsupportedCurrency ? currency_check : names[rule];
+    }
+
+    std::string declineReason(uint16_t rule, const Money& amount) const {
+        if (rule == kUnsupportedCurrency) {
+            return "Unsupported currency " + std::string(amount.currencyCode());
+        }
+        const Reason& reason = reasons[rule];
+        std::string reply = reason.prefix;
+        if (reason.has_amount) {
+            reply += amount.toString();
+            reply += reason.suffix;
+        }
+        return reply;
+    }
+
+private:
+    void addReason(const std::string& text) {
+        size_t at = text.find("{amount}");
+        if (at == std::string::npos) {
+            reasons.push_back({text, "", false});
+        } else {
+            reasons.push_back({text.substr(0, at), text.substr(at + 8), true});
+        }
+    }
+
+    uint32_t merchantOf(uint32_t ip) const {
+        auto it = std::lower_bound(terminal_merchants.begin(), terminal_merchants.end(),
+                                   std::make_pair(ip, uint32_t(0)));
+        return it != terminal_merchants.end() && it->first == ip ? it->second : 0;
+    }
+
+    static bool inWindow(uint16_t minute, uint16_t from, uint16_t to) {
+        return from <= to ? (minute >= from && minute < to) : (minute >= from || minute < to);
+    }
+
+    // Slot layout: window number in the high 32 bits, count in the low 32.
+    bool overVelocity(size_t index, const CompiledRule& rule, const RuleContext& ctx) const {
+        uint64_t hash = (static_cast<uint64_t>(ctx.terminal_ip) << 16 | index) * 0x9E3779B97F4A7C15ull;
+        std::atomic<uint64_t>& slot = velocity[hash >> 52];
+        uint64_t window = static_cast<uint64_t>(ctx.unix_ts) / rule.velocity_window_s;
+
+        uint64_t current = slot.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            uint64_t count = (current >> 32) == (window & 0xFFFFFFFF) ? (current & 0xFFFFFFFF) : 0;
+            next = (window << 32) | (count + 1);
+        } while (!slot.compare_exchange_weak(current, next, std::memory_order_relaxed));
+        return (next & 0xFFFFFFFF) > rule.velocity_limit;
+    }
+
+    static bool tokenize(const std::string& line, std::vector<std::string>& tokens) {
+        std::string token;
+        bool in_token = false;
+        bool quoted = false;
+        for (char c : line) {
+            if (quoted) {
+                if (c == '"') {
+                    quoted = false;
+                } else {
+                    token.push_back(c);
+                }
+            } else if (c == '"') {
+                quoted = true;
+                in_token = true;
+            } else if (c == '#') {
+                break;
+            } else if (c == ' ' || c == '\t' || c == '\r') {
+                if (in_token) {
+                    tokens.push_back(token);
+                    token.clear();
+                    in_token = false;
+                }
+            } else {
+                token.push_back(c);
+                in_token = true;
+            }
+        }
+        if (in_token) {
+            tokens.push_back(token);
+        }
+        return !quoted;
+    }
+
+    static bool parseIp(const std::string& text, uint32_t& ip) {
+        in_addr addr{};
+        if (inet_pton(AF_INET, text.c_str(), &addr) != 1) {
+            return false;
+        }
+        ip = ntohl(addr.s_addr);
+        return true;
+    }
+
+    static bool parseHours(const std::string& text, uint16_t& from, uint16_t& to) {
+        unsigned h1, m1, h2, m2;
+        char tail;
+        if (sscanf(text.c_str(), "%u:%u-%u:%u%c", &h1, &m1, &h2, &m2, &tail) != 4 ||
+            h1 > 24 || h2 > 24 || m1 > 59 || m2 > 59 || h1 * 60 + m1 > 1440 || h2 * 60 + m2 > 1440) {
+            return false;
+        }
+        from = static_cast<uint16_t>(h1 * 60 + m1);
+        to = static_cast<uint16_t>(h2 * 60 + m2);
+        return from != to;
+    }
+
+    static bool parseVelocity(const std::string& text, uint32_t& limit, uint32_t& window_s) {
+        unsigned count, seconds;
+        char tail;
+        if (sscanf(text.c_str(), "%u/%u%c", &count, &seconds, &tail) != 2 || seconds == 0) {
+            return false;
+        }
+        limit = count;
+        window_s = seconds;
+        return true;
+    }
+};
+
+// Publishes the active RuleSet. Workers read it with a single acquire load
+// and never lock; reload() swaps in a new set and frees the old one only
+// after every worker has finished the event-loop iteration that might still
+// be using it (see GatewayWorker::loopCount()).
+class RuleEngine {
+private:
+    std::string path;
+    std::atomic<const RuleSet*> active;
+
+public:
+    RuleEngine() : active(nullptr) {}
+
+    ~RuleEngine() {
+        delete active.load();
+    }
+
+    RuleEngine(const RuleEngine&) = delete;
+    RuleEngine& operator=(const RuleEngine&) = delete;
+
+    const RuleSet& current() const {
+        return *active.load(std::memory_order_acquire);
+    }
+
+    // Loads the rules file, or the built-in rules when path is empty.
+    bool load(const std::string& rules_path) {
+        path = rules_path;
+        std::unique_ptr<RuleSet> rules = compileFile();
+        if (!rules) {
+            return false;
+        }
+        delete active.exchange(rules.release(), std::memory_order_acq_rel);
+        return true;
+    }
+
+    // Compiles the file again and publishes it. Returns the previous set,
+    // which the caller frees once no worker can be reading it, or nullptr
+    // if the file did not compile and the current rules stay in force.
+    std::unique_ptr<const RuleSet> reload() {
+        std::unique_ptr<RuleSet> rules = compileFile();
+        if (!rules) {
+            return nullptr;
+        }
+        return std::unique_ptr<const RuleSet>(active.exchange(rules.release(), std::memory_order_acq_rel));
+    }
+
+    const std::string& source() const {
+        return path;
+    }
+
+private:
+    std::unique_ptr<RuleSet> compileFile() const {
+        auto rules = std::make_unique<RuleSet>();
+        std::string error;
+        if (path.empty()) {
+            std::istringstream in(kDefaultRules);
+            rules->compile(in, error);
+            return rules;
+        }
+
+        std::ifstream in(path);
+        if (!in) {
+            LOG_ERROR("Cannot open rules file {}", path);
+            return nullptr;
+        }
+        if (!rules->compile(in, error)) {
+            LOG_ERROR("Rules file {}: {}", path, error);
+            return nullptr;
+        }
+        LOG_INFO("Loaded {} rule(s) from {}", rules->size(), path);
+        return rules;
+    }
+};
+
+// A minimal io_uring over the raw system calls: SQEs are batched until the
+// next submitAndWait(), and receives draw from a ring of provided buffers
+// (group kBufferGroup) that the worker hands back with recycleBuffer().
+class IoUring {
+private:
+    int fd;
+    void* rings;
+    size_t rings_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned pending;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    io_uring_cqe* cqes;
+    // The ring is addressed as a plain io_uring_buf array: in C++ the
+    // header's flexible-array member lands at offset 8 instead of 0. The
+    // tail overlays the first entry's resv field.
+    io_uring_buf* buf_ring;
+    uint16_t* buf_ring_tail;
+    size_t buf_ring_size;
+    std::unique_ptr<char[]> buf_data;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_tail;
+    uint64_t buf_recycled;
+
+public:
+    static constexpr uint16_t kBufferGroup = 0;
+
+    IoUring()
+        : fd(-1), rings(MAP_FAILED), rings_size(0), sqes(nullptr), sqes_size(0), sq_head(nullptr), sq_tail(nullptr),
+          sq_array(nullptr), sq_mask(0), sq_entries(0), sqe_tail(0), pending(0), cq_head(nullptr), cq_tail(nullptr),
+          cq_mask(0), cqes(nullptr), buf_ring(nullptr), buf_ring_tail(nullptr), buf_ring_size(0), buf_count(0), buf_size(0), buf_tail(0), buf_recycled(0) {}
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    ~IoUring() {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (buf_ring) {
+            munmap(buf_ring, buf_ring_size);
+        }
+        if (sqes) {
+            munmap(sqes, sqes_size);
+        }
+        if (rings != MAP_FAILED) {
+            munmap(rings, rings_size);
+        }
+    }
+
+    // Fails with errno set when the kernel lacks io_uring or any feature
+    // used here: single-mmap rings, EXT_ARG waits, the accept/recv/send/poll
+    // opcodes and provided-buffer rings (5.19+, as is multishot accept).
+    // buffers must be a power of two.
+    bool init(unsigned entries, unsigned buffers, unsigned buffer_size) {
+        io_uring_params params{};
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd == -1) {
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            errno = EOPNOTSUPP;
+            return false;
+        }
+
+        rings_size = std::max<size_t>(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                      params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings = mmap(nullptr, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (rings == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqe_map = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqe_map == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+        char* base = static_cast<char*>(rings);
+        sq_head = reinterpret_cast<unsigned*>(base + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(base + params.sq_off.tail);
+        sq_array = reinterpret_cast<unsigned*>(base + params.sq_off.array);
+        sq_mask = *reinterpret_cast<unsigned*>(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sqe_tail = *sq_tail;
+        cq_head = reinterpret_cast<unsigned*>(base + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(base + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(base + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(base + params.cq_off.cqes);
+
+        return supportsOpcodes() && registerBuffers(buffers, buffer_size);
+    }
+
+    // The next free SQE, zeroed. Submits what is queued if the ring is full.
+    io_uring_sqe* nextSqe() {
+        if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) == sq_entries) {
+            submit();
+        }
+        unsigned index = sqe_tail & sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        sqe_tail++;
+        pending++;
+        return sqe;
+    }
+
+    // Submits the queued SQEs without waiting.
+    void submit() {
+        enter(0, -1);
+    }
+
+    // Submits the queued SQEs in one system call and waits until a
+    // completion is ready or timeout_ms (-1: no limit) passes. Returns 0 or
+    // -errno for a failure other than the timeout or a signal.
+    int submitAndWait(int timeout_ms) {
+        return enter(1, timeout_ms);
+    }
+
+    template <typename Handler>
+    void forEachCompletion(Handler&& handle) {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes[head & cq_mask];
+            __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+            handle(cqe);
+        }
+    }
+
+    const char* buffer(uint16_t bid) const {
+        return buf_data.get() + static_cast<size_t>(bid) * buf_size;
+    }
+
+    unsigned bufferSize() const {
+        return buf_size;
+    }
+
+    void recycleBuffer(uint16_t bid) {
+        io_uring_buf& entry = buf_ring[buf_tail & (buf_count - 1)];
+        entry.addr = reinterpret_cast<uint64_t>(buffer(bid));
+        entry.len = buf_size;
+        entry.bid = bid;
+        __atomic_store_n(buf_ring_tail, ++buf_tail, __ATOMIC_RELEASE);
+        ++buf_recycled;
+    }
+
+    // Total buffers handed back to the kernel; lets callers tell whether
+    // any became available since a recv failed with ENOBUFS.
+    uint64_t recycledBuffers() const {
+        return buf_recycled;
+    }
+
+private:
+    int enter(unsigned wait_nr, int timeout_ms) {
+        __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+        __kernel_timespec timeout{timeout_ms / 1000, static_cast<long long>(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg{};
+        if (timeout_ms >= 0) {
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+        }
+        unsigned flags = IORING_ENTER_EXT_ARG | (wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        long rc = syscall(__NR_io_uring_enter, fd, pending, wait_nr, flags, &arg, sizeof(arg));
+        if (rc < 0) {
+            return errno == ETIME || errno == EINTR || errno == EBUSY ? 0 : -errno;
+        }
+        pending -= static_cast<unsigned>(rc);
+        return 0;
+    }
+
+    bool supportsOpcodes() {
+        constexpr unsigned kOps = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) + kOps * sizeof(io_uring_probe_op));
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, kOps) < 0) {
+            return false;
+        }
+        for (uint8_t op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_POLL_ADD}) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+                errno = EOPNOTSUPP;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool registerBuffers(unsigned buffers, unsigned buffer_size) {
+        buf_count = buffers;
+        buf_size = buffer_size;
+        buf_ring_size = buffers * sizeof(io_uring_buf);
+        void* map = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        buf_ring = static_cast<io_uring_buf*>(map);
+        buf_ring_tail = &buf_ring[0].resv;
+        buf_data.reset(new char[static_cast<size_t>(buffers) * buffer_size]);
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+        reg.ring_entries = buffers;
+        reg.bgid = kBufferGroup;
+        if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            return false;
+        }
+        for (unsigned bid = 0; bid < buffers; bid++) {
+            recycleBuffer(static_cast<uint16_t>(bid));
+        }
+        return true;
+    }
+};
+
+class GatewayWorker : public CommitListener {
+private:
+    enum class SessionState {
+        AwaitingHello,
+        Ready
+    };
+
+    // On 1.1 (pipelined) sessions replies go out as soon as they are ready
+    // and carry the request nonce as a trailing "|<nonce>" field; 1.0
+    // sessions get them in request order without it. 2.0 (binary) sessions
+    // are pipelined too, with the frame's request id as the tag.
+    struct PendingReply {
+        uint64_t seq;
+        int waits;
+        Reply content;
+        std::string tag;
+    };
+
+    struct Connection {
+        uint64_t id;
+        int socket;
+        SessionState state;
+        RecvBuffer in;
+        std::string out;
+        bool closing;
+        std::chrono::steady_clock::time_point last_activity;
+        std::deque<PendingReply> replies;
+        uint64_t next_reply_seq;
+        bool pipelined;
+        uint32_t peer_ip;
+        bool binary;
+    };
+
+    struct Completion {
+        uint64_t conn_id;
+        uint64_t reply_seq;
+        bool ok;
+    };
+
+    enum class TimerKind {
+        Idle,
+        Reply
+    };
+
+    // An HTTP request on the metrics port; answered with one response and closed.
+    struct Scrape {
+        int socket;
+        std::string in;
+        std::string out;
+        bool answered;
+    };
+
+    // A reply being written by io_uring. It lives outside the Connection so
+    // that the bytes stay valid until the kernel reports the send, even if
+    // the connection is closed in the meantime.
+    struct InFlightSend {
+        int socket;
+        std::string data;
+        size_t offset;
+        std::chrono::steady_clock::time_point started;
+    };
+
+    enum class UringOp : uint64_t {
+        Accept = 1,
+        Recv,
+        Send,
+        EpollReady
+    };
+
+    struct Timer {
+        std::chrono::steady_clock::time_point deadline;
+        TimerKind kind;
+        uint64_t conn_id;
+        uint64_t reply_seq;
+
+        bool operator>(const Timer& other) const {
+            return deadline > other.deadline;
+        }
+    };
+
+    static constexpr uint64_t kListenerId = 0;
+    static constexpr uint64_t kWakeupId = 1;
+    static constexpr uint64_t kMetricsListenerId = 2;
+    static constexpr uint64_t kUnixListenerId = 3;
+    static constexpr uint64_t kFirstConnId = 64;
+    static constexpr int kMaxEvents = 256;
+    static constexpr unsigned kUringEntries = 1024;
+    static constexpr unsigned kUringBuffers = 512;
+    static constexpr unsigned kUringBufferSize = 2048;
+    static constexpr int kUringOpShift = 56;
+    static constexpr const char* kDatabaseErrorReply = "Database error";
+    static constexpr const char* kBusyReply = "BUSY";
+
+    int worker_id;
+    const ServerConfig& config;
+    int server_socket;
+    int unix_socket;
+    int metrics_socket;
+    int epoll_fd;
+    int wakeup_fd;
+    int idle_timeout_ms;
+    uint64_t next_conn_id;
+    std::atomic<bool> stopping;
+    TransactionWriter& writer;
+    ReplayCache& replay_cache;
+    RuleEngine& rule_engine;
+    SourceRateLimiter& source_limiter;
+    std::atomic<uint64_t> loop_count;
+    std::unordered_map<uint64_t, Connection> connections;
+    std::unordered_map<uint64_t, Scrape> scrapes;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::mutex completions_mutex;
+    std::vector<Completion> completions;
+    std::unordered_map<uint64_t, InFlightSend> sends;
+    // Set when the io_uring backend is in use; client sockets and the
+    // client listener then bypass epoll, which keeps only the wakeup
+    // eventfd and the metrics sockets.
+    std::unique_ptr<IoUring> ring;
+    // Connections whose recv failed with ENOBUFS, re-armed once the loop
+    // has returned buffers to the ring rather than spinning on the error.
+    std::vector<uint64_t> starved_recvs;
+    uint64_t starved_at = 0;
+
+public:
+    // unix_listener (-1 for none) is shared by all workers and owned by the
+    // caller.
+    GatewayWorker(int worker_id, const ServerConfig& config, TransactionWriter& writer, ReplayCache& replay_cache,
+                  RuleEngine& rule_engine, SourceRateLimiter& source_limiter, int unix_listener)
+        : worker_id(worker_id), config(config), server_socket(-1), unix_socket(unix_listener), metrics_socket(-1), epoll_fd(-1), wakeup_fd(-1),
+          idle_timeout_ms(3000), next_conn_id(kFirstConnId | (static_cast<uint64_t>(worker_id) << 48)),
+          stopping(false), writer(writer),
+          replay_cache(replay_cache), rule_engine(rule_engine),
+          source_limiter(source_limiter), loop_count(0) {}
+
+    GatewayWorker(const GatewayWorker&) = delete;
+    GatewayWorker& operator=(const GatewayWorker&) = delete;
+
+    ~GatewayWorker() {
+        for (auto& entry : connections) {
+            close(entry.second.socket);
+        }
+        for (auto& entry : scrapes) {
+            close(entry.second.socket);
+        }
+        if (metrics_socket != -1) {
+            close(metrics_socket);
+        }
+        if (wakeup_fd != -1) {
+            close(wakeup_fd);
+        }
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+        }
+        if (server_socket != -1) {
+            close(server_socket);
+        }
+    }
+
+    bool start() {
+        if (config.port != 0) {
+            server_socket = openListener(config.port, config.workers > 1, config.backlog);
+            if (server_socket == -1) {
+                return false;
+            }
+        }
+
+        if (worker_id == 0 && config.metrics_port != 0) {
+            metrics_socket = openListener(config.metrics_port, false, 16);
+            if (metrics_socket == -1) {
+                return false;
+            }
+        }
+
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd == -1) {
+            LOG_ERROR("Failed to create epoll instance: {}", strerror(errno));
+            return false;
+        }
+
+        wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (wakeup_fd == -1) {
+            LOG_ERROR("Failed to create eventfd: {}", strerror(errno));
+            return false;
+        }
+
+        if (config.io_backend == IoBackend::Uring) {
+            auto uring = std::make_unique<IoUring>();
+            if (uring->init(kUringEntries, kUringBuffers, kUringBufferSize)) {
+                ring = std::move(uring);
+            } else {
+                LOG_WARN("io_uring unavailable ({}), worker {} uses epoll", strerror(errno), worker_id);
+            }
+        }
+
+        // Every worker waits on the one Unix listener; EPOLLEXCLUSIVE wakes
+        // a single one of them per connection instead of all.
+        if ((!ring && server_socket != -1 && !watch(server_socket, kListenerId, EPOLLIN | EPOLLET)) ||
+            (!ring && unix_socket != -1 && !watch(unix_socket, kUnixListenerId, EPOLLIN | EPOLLEXCLUSIVE)) ||
+            !watch(wakeup_fd, kWakeupId, EPOLLIN | EPOLLET)) {
+            LOG_ERROR("Failed to register worker descriptors: {}", strerror(errno));
+            return false;
+        }
+        if (metrics_socket != -1 && !watch(metrics_socket, kMetricsListenerId, EPOLLIN | EPOLLET)) {
+            LOG_ERROR("Failed to register metrics listener: {}", strerror(errno));
+            return false;
+        }
+
+        return true;
+    }
+
+    void run() {
+        if (ring) {
+            runUring();
+            return;
+        }
+
+        epoll_event events[kMaxEvents];
+
+        while (!stopping.load(std::memory_order_relaxed)) {
+            loop_count.fetch_add(1);
+            int n = epoll_wait(epoll_fd, events, kMaxEvents, nextTimerTimeoutMs());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                LOG_ERROR("epoll_wait failed: {}", strerror(errno));
+                return;
+            }
+
+            dispatchEvents(events, n);
+            runExpiredTimers();
+        }
+    }
+
+    bool usesUring() const {
+        return ring != nullptr;
+    }
+
+    void stop() {
+        stopping = true;
+        wake();
+    }
+
+    // Advances once per event-loop iteration. Nothing read from the
+    // RuleEngine is kept across iterations, so once this has moved past a
+    // value sampled after a rules swap, the worker is done with the old set.
+    uint64_t loopCount() const {
+        return loop_count.load();
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t ignored = write(wakeup_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    // Called for every stored record, also those whose reply was not held
+    // (Durability::Enqueue, declines), so that a failed insert never stays
+    // cached as the nonce's answer. A held approval is only cached here,
+    // once it is known to be stored.
+    void onCommitted(const PendingTransaction& txn, bool ok) override {
+        if (replay_cache.windowSeconds() > 0) {
+            const TransactionRecord& r = txn.record;
+            if (!ok) {
+                replay_cache.release(r.nonce, r.unix_ts);
+            } else if (txn.awaited) {
+                replay_cache.finish(r.nonce, r.unix_ts, Reply::approved(r.auth_code, r.masked_pan, r.rrn));
+            }
+        }
+        if (!txn.awaited) {
+            return;
+        }
+
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(completions_mutex);
+            was_empty = completions.empty();
+            completions.push_back({txn.conn_id, txn.reply_seq, ok});
+        }
+        if (was_empty) {
+            wake();
+        }
+    }
+
+private:
+    int openListener(int port, bool reuse_port, int backlog) {
+        int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener == -1) {
+            LOG_ERROR("Failed to create socket");
+            return -1;
+        }
+
+        int opt = 1;
+        if (setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+            LOG_ERROR("Failed to set socket options");
+            close(listener);
+            return -1;
+        }
+        if (reuse_port && setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            LOG_ERROR("Failed to set SO_REUSEPORT: {}", strerror(errno));
+            close(listener);
+            return -1;
+        }
+
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(port);
+
+        if (bind(listener, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            LOG_ERROR("Bind failed on port {}: {}", port, strerror(errno));
+            LOG_ERROR("Port may already be in use. Try a different port or wait a moment.");
+            close(listener);
+            return -1;
+        }
+
+        if (listen(listener, backlog) < 0) {
+            LOG_ERROR("Listen failed");
+            close(listener);
+            return -1;
+        }
+
+        return listener;
+    }
+
+    void dispatchEvents(const epoll_event* events, int n) {
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == kListenerId) {
+                acceptClients(server_socket);
+            } else if (id == kUnixListenerId) {
+                acceptClients(unix_socket);
+            } else if (id == kWakeupId) {
+                drainCompletions();
+            } else if (id == kMetricsListenerId) {
+                acceptScrapes();
+            } else if (!scrapes.empty() && scrapes.count(id)) {
+                handleScrapeEvent(id);
+            } else {
+                handleConnectionEvent(id, events[i].events);
+            }
+        }
+    }
+
+    // The io_uring event loop. Each iteration submits every SQE queued
+    // since the last one (re-armed receives, replies, accepts) in a single
+    // io_uring_enter that also waits for completions. The epoll instance is
+    // polled through the ring for writer completions and metrics scrapes.
+    void runUring() {
+        epoll_event events[kMaxEvents];
+        if (server_socket != -1) {
+            armAccept(server_socket, kListenerId);
+        }
+        if (unix_socket != -1) {
+            armAccept(unix_socket, kUnixListenerId);
+        }
+        armEpollPoll();
+
+        while (!stopping.load(std::memory_order_relaxed)) {
+            loop_count.fetch_add(1);
+            int rc = ring->submitAndWait(nextTimerTimeoutMs());
+            if (rc < 0) {
+                LOG_ERROR("io_uring_enter failed: {}", strerror(-rc));
+                return;
+            }
+
+            ring->forEachCompletion([&](const io_uring_cqe& cqe) {
+                uint64_t id = cqe.user_data & ((uint64_t{1} << kUringOpShift) - 1);
+                switch (static_cast<UringOp>(cqe.user_data >> kUringOpShift)) {
+                case UringOp::Accept:
+                    onUringAccept(id, cqe);
+                    break;
+                case UringOp::Recv:
+                    onUringRecv(id, cqe);
+                    break;
+                case UringOp::Send:
+                    onUringSend(id, cqe.res);
+                    break;
+                case UringOp::EpollReady:
+                    dispatchEvents(events, std::max(epoll_wait(epoll_fd, events, kMaxEvents, 0), 0));
+                    armEpollPoll();
+                    break;
+                }
+            });
+
+            if (!starved_recvs.empty() && ring->recycledBuffers() != starved_at) {
+                for (uint64_t id : starved_recvs) {
+                    auto it = connections.find(id);
+                    if (it != connections.end() && !it->second.closing) {
+                        armRecv(it->second);
+                    }
+                }
+                starved_recvs.clear();
+            }
+
+            runExpiredTimers();
+        }
+    }
+
+    static uint64_t uringData(UringOp op, uint64_t id) {
+        return (static_cast<uint64_t>(op) << kUringOpShift) | id;
+    }
+
+    void armAccept(int listener, uint64_t listener_id) {
+        io_uring_sqe* sqe = ring->nextSqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listener;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = uringData(UringOp::Accept, listener_id);
+    }
+
+    void armEpollPoll() {
+        io_uring_sqe* sqe = ring->nextSqe();
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = epoll_fd;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = uringData(UringOp::EpollReady, 0);
+    }
+
+    void armRecv(const Connection& conn) {
+        io_uring_sqe* sqe = ring->nextSqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn.socket;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IoUring::kBufferGroup;
+        sqe->len = ring->bufferSize();
+        sqe->user_data = uringData(UringOp::Recv, conn.id);
+    }
+
+    void armSend(uint64_t id, const InFlightSend& send) {
+        io_uring_sqe* sqe = ring->nextSqe();
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = send.socket;
+        sqe->addr = reinterpret_cast<uint64_t>(send.data.data() + send.offset);
+        sqe->len = static_cast<uint32_t>(send.data.size() - send.offset);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = uringData(UringOp::Send, id);
+    }
+
+    void onUringAccept(uint64_t listener_id, const io_uring_cqe& cqe) {
+        if (cqe.res >= 0) {
+            sockaddr_storage client_addr{};
+            socklen_t client_len = sizeof(client_addr);
+            getpeername(cqe.res, (struct sockaddr*)&client_addr, &client_len);
+            addConnection(cqe.res, peerIp(client_addr));
+        } else if (cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+            LOG_ERROR("Accept failed: {}", strerror(-cqe.res));
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE) && !stopping.load(std::memory_order_relaxed)) {
+            armAccept(listener_id == kUnixListenerId ? unix_socket : server_socket, listener_id);
+        }
+    }
+
+    // The io_uring counterpart of readInput(): feeds the received bytes
+    // through the same line framing and session logic.
+    void onUringRecv(uint64_t id, const io_uring_cqe& cqe) {
+        bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            if (has_buffer) {
+                ring->recycleBuffer(bid);
+            }
+            return;
+        }
+        Connection& conn = it->second;
+
+        if (cqe.res > 0 && has_buffer) {
+            conn.last_activity = std::chrono::steady_clock::now();
+            const char* bytes = ring->buffer(bid);
+            size_t size = static_cast<size_t>(cqe.res);
+            while (size > 0 && !conn.closing) {
+                size_t taken = conn.in.append(bytes, size);
+                if (taken == 0) {
+                    LOG_ERROR("Request line too long, closing connection");
+                    conn.closing = true;
+                    break;
+                }
+                bytes += taken;
+                size -= taken;
+                processInput(conn);
+            }
+            ring->recycleBuffer(bid);
+            if (!conn.closing) {
+                armRecv(conn);
+            }
+        } else if (cqe.res == -ENOBUFS) {
+            if (starved_recvs.empty()) {
+                starved_at = ring->recycledBuffers();
+            }
+            starved_recvs.push_back(conn.id);
+        } else {
+            if (has_buffer) {
+                ring->recycleBuffer(bid);
+            }
+            if (!conn.closing && !conn.binary && !conn.in.empty()) {
+                handleLine(conn, conn.in.takeRemaining());
+            }
+            conn.closing = true;
+        }
+
+        finishIo(conn);
+    }
+
+    void onUringSend(uint64_t id, int result) {
+        auto it = sends.find(id);
+        if (it == sends.end()) {
+            return;
+        }
+        InFlightSend& send = it->second;
+        auto conn_it = connections.find(id);
+        if (conn_it == connections.end()) {
+            sends.erase(it);
+            return;
+        }
+        if (result < 0) {
+            sends.erase(it);
+            closeConnection(id);
+            return;
+        }
+
+        send.offset += static_cast<size_t>(result);
+        if (send.offset < send.data.size()) {
+            armSend(id, send);
+            return;
+        }
+        Metrics::observe(MetricTimer::Send, std::chrono::steady_clock::now() - send.started);
+        sends.erase(it);
+        finishIo(conn_it->second);
+    }
+
+    // Hands conn.out to the kernel unless a send for the connection is
+    // still in flight; its completion picks up whatever has queued since.
+    void startSend(Connection& conn) {
+        auto [it, idle] = sends.try_emplace(conn.id);
+        if (!idle) {
+            return;
+        }
+        InFlightSend& send = it->second;
+        send.socket = conn.socket;
+        send.data.swap(conn.out);
+        send.offset = 0;
+        send.started = std::chrono::steady_clock::now();
+        armSend(conn.id, send);
+    }
+
+    bool watch(int fd, uint64_t id, uint32_t events) {
+        epoll_event ev{};
+        ev.events = events;
+        ev.data.u64 = id;
+        return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+    }
+
+    // Unix-socket clients are on this host, so rules and rate limits see
+    // them as 127.0.0.1.
+    static uint32_t peerIp(const sockaddr_storage& addr) {
+        if (addr.ss_family == AF_INET) {
+            return ntohl(reinterpret_cast<const sockaddr_in&>(addr).sin_addr.s_addr);
+        }
+        return INADDR_LOOPBACK;
+    }
+
+    void acceptClients(int listener) {
+        while (true) {
+            sockaddr_storage client_addr{};
+            socklen_t client_len = sizeof(client_addr);
+
+            int client_socket = accept4(listener, (struct sockaddr*)&client_addr, &client_len,
+                                        SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Accept failed: {}", strerror(errno));
+                }
+                return;
+            }
+
+            addConnection(client_socket, peerIp(client_addr));
+        }
+    }
+
+    void addConnection(int client_socket, uint32_t peer_ip) {
+        uint64_t id = next_conn_id++;
+        if (!ring && !watch(client_socket, id, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+            LOG_ERROR("Failed to register client socket: {}", strerror(errno));
+            close(client_socket);
+            return;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = connections.emplace(id, Connection{id, client_socket, SessionState::AwaitingHello, RecvBuffer(), "",
+                                                     false, now, {}, 0, false, peer_ip, false}).first;
+        timers.push({now + std::chrono::milliseconds(idle_timeout_ms), TimerKind::Idle, id, 0});
+        Metrics::increment(MetricCounter::Accepts);
+        trace(TracePhase::Accept, id);
+        Metrics::addGauge(MetricGauge::OpenConnections, 1);
+        if (ring) {
+            armRecv(it->second);
+        }
+
+        LOG_DEBUG("Client connected, waiting for handshake...");
+    }
+
+    void acceptScrapes() {
+        while (true) {
+            int client_socket = accept4(metrics_socket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    LOG_ERROR("Metrics accept failed: {}", strerror(errno));
+                }
+                return;
+            }
+
+            uint64_t id = next_conn_id++;
+            if (!watch(client_socket, id, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET)) {
+                close(client_socket);
+                continue;
+            }
+            scrapes.emplace(id, Scrape{client_socket, "", "", false});
+        }
+    }
+
+    // Any request that completes its headers gets the current metrics; the
+    // path and method are not looked at.
+    void handleScrapeEvent(uint64_t id) {
+        Scrape& scrape = scrapes.find(id)->second;
+        bool open = true;
+
+        char buffer[1024];
+        while (!scrape.answered) {
+            ssize_t n = recv(scrape.socket, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                scrape.in.append(buffer, n);
+                if (scrape.in.find("\r\n\r\n") != std::string::npos || scrape.in.find("\n\n") != std::string::npos) {
+                    std::string body = Metrics::instance().renderPrometheus();
+                    scrape.out = "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                 std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+                    scrape.answered = true;
+                } else if (scrape.in.size() > 8192) {
+                    open = false;
+                    break;
+                }
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+            break;
+        }
+
+        while (open && !scrape.out.empty()) {
+            ssize_t n = send(scrape.socket, scrape.out.data(), scrape.out.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                scrape.out.erase(0, n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else {
+                open = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                break;
+            }
+        }
+
+        if (!open || (scrape.answered && scrape.out.empty())) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, scrape.socket, nullptr);
+            close(scrape.socket);
+            scrapes.erase(id);
+        }
+    }
+
+    void handleConnectionEvent(uint64_t id, uint32_t events) {
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        Connection& conn = it->second;
+
+        if (events & EPOLLOUT) {
+            if (!flushOutput(conn)) {
+                closeConnection(id);
+                return;
+            }
+        }
+
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            if (!readInput(conn)) {
+                conn.closing = true;
+            }
+        }
+
+        finishIo(conn);
+    }
+
+    void drainCompletions() {
+        uint64_t counter;
+        while (read(wakeup_fd, &counter, sizeof(counter)) > 0) {
+        }
+
+        std::vector<Completion> ready;
+        {
+            std::lock_guard<std::mutex> lock(completions_mutex);
+            ready.swap(completions);
+        }
+
+        for (const auto& completion : ready) {
+            auto it = connections.find(completion.conn_id);
+            if (it == connections.end()) {
+                continue;
+            }
+            if (!completion.ok) {
+                LOG_ERROR("Database insert failed");
+            }
+            completeReplyWait(it->second, completion.reply_seq, completion.ok ? nullptr : kDatabaseErrorReply);
+        }
+    }
+
+    void finishIo(Connection& conn) {
+        if (conn.pipelined) {
+            for (auto it = conn.replies.begin(); it != conn.replies.end();) {
+                if (it->waits == 0) {
+                    sendReply(conn, *it);
+                    it = conn.replies.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        } else {
+            while (!conn.replies.empty() && conn.replies.front().waits == 0) {
+                sendReply(conn, conn.replies.front());
+                conn.replies.pop_front();
+            }
+        }
+
+        if (!flushOutput(conn)) {
+            closeConnection(conn.id);
+            return;
+        }
+
+        if (conn.closing && conn.replies.empty() && conn.out.empty() && (sends.empty() || !sends.count(conn.id))) {
+            closeConnection(conn.id);
+        }
+    }
+
+    bool readInput(Connection& conn) {
+        while (!conn.closing) {
+            ssize_t n = conn.in.fill(conn.socket);
+            if (n > 0) {
+                conn.last_activity = std::chrono::steady_clock::now();
+                processInput(conn);
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            if (n == -2) {
+                LOG_ERROR("Request line too long, closing connection");
+                conn.closing = true;
+                return true;
+            }
+            if (!conn.closing && !conn.binary && !conn.in.empty()) {
+                handleLine(conn, conn.in.takeRemaining());
+            }
+            return false;
+        }
+        return true;
+    }
+
+    bool flushOutput(Connection& conn) {
+        if (conn.out.empty()) {
+            return true;
+        }
+        if (ring) {
+            startSend(conn);
+            return true;
+        }
+        auto started = std::chrono::steady_clock::now();
+        bool ok = writeOutput(conn);
+        Metrics::observe(MetricTimer::Send, std::chrono::steady_clock::now() - started);
+        return ok;
+    }
+
+    bool writeOutput(Connection& conn) {
+        while (!conn.out.empty()) {
+            ssize_t n = send(conn.socket, conn.out.data(), conn.out.size(), MSG_NOSIGNAL);
+            if (n > 0) {
+                conn.out.erase(0, n);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return true;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Handles every complete line or frame in the buffer; a session turns
+    // binary right after its 2.0 handshake line.
+    void processInput(Connection& conn) {
+        std::string_view unit;
+        while (!conn.closing) {
+            if (conn.binary) {
+                if (!conn.in.nextFrame(unit, kMaxFrameSize)) {
+                    break;
+                }
+                handleFrame(conn, unit);
+            } else {
+                if (!conn.in.nextLine(unit)) {
+                    break;
+                }
+                handleLine(conn, unit);
+            }
+        }
+    }
+
+    void handleLine(Connection& conn, std::string_view line) {
+        if (conn.state == SessionState::AwaitingHello) {
+            LOG_DEBUG("Received: {}", line);
+
+            if (line == "HELLO|GW|1.1") {
+                sendLine(conn, "HELLO|TERM|1.1");
+                conn.pipelined = true;
+            } else if (line == "HELLO|GW|2.0") {
+                sendLine(conn, "HELLO|TERM|2.0");
+                conn.pipelined = true;
+                conn.binary = true;
+            } else if (line == "HELLO|GW|1.0") {
+                sendLine(conn, "HELLO|TERM|1.0");
+            } else {
+                LOG_WARN("Invalid handshake received: {}", line);
+                Metrics::increment(MetricCounter::HandshakeFailures);
+                conn.closing = true;
+                return;
+            }
+
+            conn.state = SessionState::Ready;
+            trace(TracePhase::HandshakeComplete, conn.id);
+            LOG_DEBUG("Handshake completed, waiting for AUTH...");
+            return;
+        }
+
+        if (line.empty()) {
+            conn.closing = true;
+            return;
+        }
+
+        LOG_DEBUG("Received: {}", line);
+
+        if (line == "PING") {
+            queueReply(conn, Reply::pong());
+            return;
+        }
+
+        if (line.substr(0, 5) == "AUTH|") {
+            trace(TracePhase::LineFramed, conn.id, conn.next_reply_seq);
+            processAuthRequest(conn, line);
+        } else {
+            queueReply(conn, Reply::declined(ReplyCode::InvalidRequest, "Invalid request format"));
+        }
+    }
+
+    void handleFrame(Connection& conn, std::string_view frame) {
+        if (frame.empty()) {
+            LOG_WARN("Corrupt frame length, closing connection");
+            Metrics::increment(MetricCounter::AuthParseErrors);
+            conn.closing = true;
+            return;
+        }
+
+        switch (frameType(frame)) {
+            case FrameType::Auth:
+                trace(TracePhase::LineFramed, conn.id, conn.next_reply_seq);
+                processAuthFrame(conn, frame);
+                break;
+            case FrameType::Ping:
+                queueReply(conn, Reply::pong(), frameTag(frame));
+                break;
+            default:
+                queueReply(conn, Reply::declined(ReplyCode::InvalidRequest, "Invalid request format"),
+                           frameTag(frame));
+                break;
+        }
+    }
+
+    void sendLine(Connection& conn, std::string_view line) {
+        conn.out.append(line);
+        conn.out.push_back('\n');
+    }
+
+    void sendReply(Connection& conn, const PendingReply& reply) {
+        trace(TracePhase::ReplySent, conn.id, reply.seq);
+        if (conn.binary) {
+            appendReplyFrame(conn.out, reply.content, reply.tag);
+            LOG_DEBUG("Sent frame: code {}", static_cast<int>(reply.content.code));
+            return;
+        }
+        std::string text = reply.content.text();
+        if (reply.tag.empty()) {
+            sendLine(conn, text);
+            LOG_DEBUG("Sent: {}", text);
+            return;
+        }
+        conn.out.append(text);
+        conn.out.push_back('|');
+        conn.out.append(reply.tag);
+        conn.out.push_back('\n');
+        LOG_DEBUG("Sent: {}|{}", text, reply.tag);
+    }
+
+    PendingReply& queueReply(Connection& conn, Reply reply, std::string_view tag = {}) {
+        conn.replies.push_back({conn.next_reply_seq++, 0, std::move(reply),
+                                conn.pipelined ? std::string(tag) : std::string()});
+        return conn.replies.back();
+    }
+
+    void closeConnection(uint64_t id) {
+        auto it = connections.find(id);
+        if (it == connections.end()) {
+            return;
+        }
+        if (ring) {
+            // Ends the receive (and any send) still held by the kernel, and
+            // submits queued SQEs while the descriptor number cannot yet be
+            // reused by an accept.
+            shutdown(it->second.socket, SHUT_RDWR);
+            ring->submit();
+        } else {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, it->second.socket, nullptr);
+        }
+        close(it->second.socket);
+        connections.erase(it);
+        Metrics::addGauge(MetricGauge::OpenConnections, -1);
+        LOG_DEBUG("Client disconnected");
+    }
+
+    int nextTimerTimeoutMs() const {
+        if (timers.empty()) {
+            return -1;
+        }
+        auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+            timers.top().deadline - std::chrono::steady_clock::now()).count();
+        return remaining > 0 ? static_cast<int>((remaining + 999) / 1000) : 0;
+    }
+
+    void runExpiredTimers() {
+        auto now = std::chrono::steady_clock::now();
+        while (!timers.empty() && timers.top().deadline <= now) {
+            Timer timer = timers.top();
+            timers.pop();
+
+            auto it = connections.find(timer.conn_id);
+            if (it == connections.end()) {
+                continue;
+            }
+
+            if (timer.kind == TimerKind::Reply) {
+                completeReplyWait(it->second, timer.reply_seq, nullptr);
+                continue;
+            }
+
+            auto deadline = it->second.last_activity + std::chrono::milliseconds(idle_timeout_ms);
+            if (!it->second.replies.empty()) {
+                deadline = now + std::chrono::milliseconds(idle_timeout_ms);
+            }
+            if (deadline > now) {
+                timers.push({deadline, TimerKind::Idle, timer.conn_id, 0});
+                continue;
+            }
+
+            if (it->second.state == SessionState::AwaitingHello) {
+                LOG_WARN("Handshake timed out");
+                Metrics::increment(MetricCounter::HandshakeFailures);
+            }
+            closeConnection(timer.conn_id);
+        }
+    }
+
+    void completeReplyWait(Connection& conn, uint64_t reply_seq, const char* failure_text) {
+        for (auto& reply : conn.replies) {
+            if (reply.seq == reply_seq) {
+                if (failure_text) {
+                    reply.content = Reply::declined(ReplyCode::DatabaseError, failure_text);
+                }
+                reply.waits--;
+                break;
+            }
+        }
+        finishIo(conn);
+    }
+
+    // Overload shedding and per-source limiting. A refused request is
+    // answered at once and leaves no trace in the replay cache, so the
+    // client may retry it with the same nonce.
+    bool admitRequest(Connection& conn, std::string_view tag) {
+        if (conn.replies.size() >= config.max_pending || writer.backlog() >= config.busy_backlog) {
+            Metrics::increment(MetricCounter::Shed);
+            queueReply(conn, Reply::declined(ReplyCode::Busy, kBusyReply), tag);
+            return false;
+        }
+        if (!source_limiter.admit(conn.peer_ip)) {
+            Metrics::increment(MetricCounter::RateLimited);
+            queueReply(conn, Reply::declined(ReplyCode::RateLimited, "Rate limit exceeded"), tag);
+            return false;
+        }
+        return true;
+    }
+
+    // Returns false when the request was answered from the replay cache
+    // or rejected; the caller must not process it any further.
+    bool checkReplay(Connection& conn, const AuthRequest& request, std::string_view tag) {
+        if (replay_cache.isStale(request.unix_ts, getCurrentUnixTimestamp())) {
+            LOG_DEBUG("Stale timestamp: {}", request.unix_ts);
+            queueReply(conn, Reply::declined(ReplyCode::StaleTimestamp, "Stale timestamp"), tag);
+            return false;
+        }
+
+        Reply cached;
+        switch (replay_cache.begin(request.nonceView(), request.unix_ts, getCurrentUnixTimestamp(), cached)) {
+            case ReplayStatus::New:
+                return true;
+            case ReplayStatus::Duplicate:
+                LOG_DEBUG("Duplicate AUTH for nonce {}, replaying cached reply", request.nonceView());
+                queueReply(conn, std::move(cached), tag);
+                return false;
+            case ReplayStatus::InProgress:
+                queueReply(conn, Reply::declined(ReplyCode::DuplicateInProgress, "Duplicate request in progress"), tag);
+                return false;
+            case ReplayStatus::Replayed:
+                LOG_WARN("Nonce {} reused with a different timestamp", request.nonceView());
+                queueReply(conn, Reply::declined(ReplyCode::NonceReused, "Nonce already used"), tag);
+                return false;
+            case ReplayStatus::Full:
+                LOG_WARN("Replay cache full, nonce {} not tracked", request.nonceView());
+                return true;
+        }
+        return true;
+    }
+
+    // False if the writer's queue was full and the record was dropped.
+    bool storeTransaction(Connection& conn, const TransactionRecord& record, PendingReply& reply) {
+        bool wait = record.approved && config.durability == Durability::Commit;
+
+        if (!writer.submit({record, this, conn.id, reply.seq, std::chrono::steady_clock::now(), wait})) {
+            LOG_WARN("Transaction queue full");
+            if (record.approved) {
+                reply.content = Reply::declined(ReplyCode::DatabaseBusy, "Database busy");
+            }
+            return false;
+        }
+        trace(TracePhase::Enqueued, conn.id, reply.seq);
+        if (wait) {
+            reply.waits++;
+        }
+        return true;
+    }
+
+    // Holds the reply back for the simulated acquirer round trip without
+    // blocking the loop; other connections keep being served meanwhile.
+    void delayReply(Connection& conn, PendingReply& reply) {
+        auto delay = config.latency.sample();
+        if (delay.count() <= 0) {
+            return;
+        }
+        reply.waits++;
+        timers.push({std::chrono::steady_clock::now() + delay, TimerKind::Reply, conn.id, reply.seq});
+    }
+
+    void processAuthRequest(Connection& conn, std::string_view line) {
+        LOG_DEBUG("Processing AUTH request: {}", line);
+
+        auto parse_started = std::chrono::steady_clock::now();
+        AuthRequest request;
+        AuthParseError error = parseAuthRequest(line, request);
+        processAuth(conn, request, error, parse_started,
+                    error == AuthParseError::None ? request.nonceView() : authCorrelationTag(line));
+    }
+
+    void processAuthFrame(Connection& conn, std::string_view frame) {
+        auto parse_started = std::chrono::steady_clock::now();
+        AuthRequest request;
+        AuthParseError error = decodeAuthFrame(frame, request);
+        processAuth(conn, request, error, parse_started, frameTag(frame));
+    }
+
+    // The protocol-independent part of an AUTH; tag correlates the reply
+    // on pipelined sessions.
+    void processAuth(Connection& conn, const AuthRequest& request, AuthParseError error,
+                     std::chrono::steady_clock::time_point parse_started, std::string_view tag) {
+        auto parsed = std::chrono::steady_clock::now();
+        Metrics::observe(MetricTimer::Parse, parsed - parse_started);
+        trace(TracePhase::Parsed, conn.id, conn.next_reply_seq);
+        if (error != AuthParseError::None) {
+            Metrics::increment(MetricCounter::AuthParseErrors);
+            LOG_DEBUG("Invalid AUTH request: {}", authParseErrorReason(error));
+            queueReply(conn, Reply::declined(ReplyCode::InvalidRequest, authParseErrorReason(error)), tag);
+            return;
+        }
+
+        LOG_DEBUG("Parsed values: amount={}, unix_ts={}, nonce={}", request.amount.toString(),
+                  request.unix_ts, request.nonceView());
+
+        if (!admitRequest(conn, tag)) {
+            return;
+        }
+
+        if (replay_cache.windowSeconds() > 0 && !checkReplay(conn, request, tag)) {
+            return;
+        }
+
+        const RuleSet& rules = rule_engine.current();
+        RuleSet::Decision decision = rules.evaluate({conn.peer_ip, request.amount, request.unix_ts});
+        bool approved = decision.approved;
+        LOG_DEBUG("Transaction approved: {} (rule {})", approved, rules.ruleName(decision.rule));
+        Metrics::increment(approved ? MetricCounter::Approvals : MetricCounter::Declines);
+
+        TransactionRecord record{};
+        record.amount = request.amount;
+        record.approved = approved;
+        record.unix_ts = request.unix_ts;
+        copyField(record.nonce, request.nonceView());
+
+        Reply response;
+        if (approved) {
+            std::string auth_code = generateAuthCode();
+            std::string masked_pan = generateMaskedPAN();
+            std::string rrn = generateRRN();
+
+            LOG_DEBUG("Generated: auth_code={}, masked_pan={}, rrn={}", auth_code, masked_pan, rrn);
+
+            copyField(record.auth_code, auth_code);
+            copyField(record.masked_pan, masked_pan);
+            copyField(record.rrn, rrn);
+
+            response = Reply::approved(auth_code, masked_pan, rrn);
+
+            LOG_DEBUG("Storing approved transaction...");
+        } else {
+            response = Reply::declined(ReplyCode::Declined, rules.declineReason(decision.rule, request.amount));
+
+            LOG_DEBUG("Storing declined transaction...");
+        }
+
+        LOG_DEBUG("Generated response: {}", response.text());
+        Metrics::observe(MetricTimer::Decision, std::chrono::steady_clock::now() - parsed);
+        trace(TracePhase::Decided, conn.id, conn.next_reply_seq);
+
+        PendingReply& reply = queueReply(conn, response, tag);
+
+        // A reply that is not held for the commit is cached before the
+        // record reaches the writer, so a failed insert reported by
+        // onCommitted() always comes after it and releases the nonce again.
+        // A held approval stays in progress until onCommitted() caches it.
+        bool cache = replay_cache.windowSeconds() > 0;
+        if (cache && !(approved && config.durability == Durability::Commit)) {
+            replay_cache.finish(request.nonceView(), request.unix_ts, response);
+        }
+        if (!storeTransaction(conn, record, reply) && cache) {
+            replay_cache.release(request.nonceView(), request.unix_ts);
+        }
+        delayReply(conn, reply);
+    }
+};
+
+class PaymentGatewayServer {
+private:
+    ServerConfig config;
+    // One database and writer shared by all workers, or in sharded mode
+    // one per worker so that inserts never contend across threads.
+    std::vector<std::unique_ptr<TransactionDB>> dbs;
+    std::vector<std::unique_ptr<TransactionJournal>> journals;
+    ReplayCache replay_cache;
+    RuleEngine rules;
+    SourceRateLimiter source_limiter;
+    std::vector<std::unique_ptr<GatewayWorker>> workers;
+    std::vector<std::unique_ptr<TransactionWriter>> writers;
+    int unix_socket;
+
+public:
+    explicit PaymentGatewayServer(const ServerConfig& config)
+        : config(config), replay_cache(config.replay_capacity, config.replay_window),
+          source_limiter(config.source_rate, config.source_burst, 65536), unix_socket(-1) {}
+
+    ~PaymentGatewayServer() {
+        if (unix_socket != -1) {
+            close(unix_socket);
+            unlink(config.unix_path.c_str());
+        }
+    }
+
+    bool start() {
+        int shards = config.sharded_storage ? config.workers : 1;
+        for (int i = 0; i < shards; i++) {
+            auto db = std::make_unique<TransactionDB>();
+            bool ok = config.sharded_storage ? db->init(shardDatabasePath(i), i) : db->init();
+            if (!ok) {
+                LOG_ERROR("Failed to initialize database");
+                return false;
+            }
+            TransactionJournal* journal = nullptr;
+            if (!config.journal_dir.empty()) {
+                journals.push_back(std::make_unique<TransactionJournal>(
+                    *db, config.journal_dir, config.sharded_storage ? "shard" + std::to_string(i) : "journal",
+                    config.journal_segment_records, config.journal_sync, config.journal_sync_interval_ms));
+                journal = journals.back().get();
+                if (!journal->open(config.sharded_storage ? i : -1)) {
+                    LOG_ERROR("Failed to open the transaction journal");
+                    return false;
+                }
+            }
+            writers.push_back(std::make_unique<TransactionWriter>(*db, config.batch_size, config.flush_interval_ms,
+                                                                  65536, journal));
+            dbs.push_back(std::move(db));
+        }
+
+        if (!rules.load(config.rules_path)) {
+            return false;
+        }
+
+        if (!config.trace_path.empty() && !Tracer::instance().open(config.trace_path)) {
+            LOG_ERROR("Failed to open trace file {}: {}", config.trace_path, strerror(errno));
+            return false;
+        }
+
+        if (!config.unix_path.empty() && !openUnixListener()) {
+            return false;
+        }
+
+        for (int i = 0; i < config.workers; i++) {
+            TransactionWriter& writer = *writers[config.sharded_storage ? i : 0];
+            auto worker = std::make_unique<GatewayWorker>(i, config, writer, replay_cache, rules, source_limiter,
+                                                          unix_socket);
+            if (!worker->start()) {
+                return false;
+            }
+            workers.push_back(std::move(worker));
+        }
+
+        if (config.io_backend == IoBackend::Uring && workers.front()->usesUring()) {
+            LOG_INFO("Using the io_uring transport");
+        }
+        std::string endpoints;
+        if (config.port != 0) {
+            endpoints = "port " + std::to_string(config.port);
+        }
+        if (!config.unix_path.empty()) {
+            endpoints += (endpoints.empty() ? "" : " and ") + config.unix_path;
+        }
+        if (config.sharded_storage) {
+            LOG_INFO("Payment Gateway Terminal listening on {} ({} workers, sharded storage)", endpoints, config.workers);
+        } else if (config.workers > 1) {
+            LOG_INFO("Payment Gateway Terminal listening on {} ({} workers)", endpoints, config.workers);
+        } else {
+            LOG_INFO("Payment Gateway Terminal listening on {}", endpoints);
+        }
+        return true;
+    }
+
+    // Serves until SIGINT/SIGTERM, then stops the workers and lets the
+    // writer commit everything still queued. SIGHUP reloads the rules.
+    void run() {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+        Logger::instance().startAsync();
+        for (auto& writer : writers) {
+            writer->start();
+        }
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < workers.size(); i++) {
+            threads.emplace_back([this, i] { workers[i]->run(); });
+            if (!config.cpus.empty()) {
+                pinThread(threads.back(), config.cpus[i % config.cpus.size()]);
+            }
+        }
+
+        int signal_number = 0;
+        while (sigwait(&signals, &signal_number) == 0 && signal_number == SIGHUP) {
+            reloadRules();
+        }
+        LOG_INFO("Shutting down on signal {}...", signal_number);
+
+        for (auto& worker : workers) {
+            worker->stop();
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        for (auto& writer : writers) {
+            writer->stop();
+        }
+        for (auto& journal : journals) {
+            journal->close();
+        }
+        Tracer::instance().close();
+        Logger::instance().stopAsync();
+    }
+
+private:
+    // A socket file left behind by an earlier run is replaced; any other
+    // file at the path is an error.
+    bool openUnixListener() {
+        sockaddr_un addr{};
+        if (config.unix_path.size() >= sizeof(addr.sun_path)) {
+            LOG_ERROR("Unix socket path too long: {}", config.unix_path);
+            return false;
+        }
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, config.unix_path.c_str(), config.unix_path.size() + 1);
+
+        struct stat info;
+        if (lstat(config.unix_path.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                LOG_ERROR("{} exists and is not a socket", config.unix_path);
+                return false;
+            }
+            unlink(config.unix_path.c_str());
+        }
+
+        int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener == -1) {
+            LOG_ERROR("Failed to create Unix socket: {}", strerror(errno));
+            return false;
+        }
+        if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            LOG_ERROR("Bind failed on {}: {}", config.unix_path, strerror(errno));
+            close(listener);
+            return false;
+        }
+        if (listen(listener, config.backlog) < 0) {
+            LOG_ERROR("Listen failed on {}: {}", config.unix_path, strerror(errno));
+            close(listener);
+            unlink(config.unix_path.c_str());
+            return false;
+        }
+        unix_socket = listener;
+        return true;
+    }
+
+    void reloadRules() {
+        if (rules.source().empty()) {
+            LOG_WARN("SIGHUP ignored: no --rules file to reload");
+            return;
+        }
+        std::unique_ptr<const RuleSet> retired = rules.reload();
+        if (!retired) {
+            LOG_WARN("Keeping the current rules");
+            return;
+        }
+
+        // Grace period: wait until every worker has started a new loop
+        // iteration, after which none can still hold the retired set.
+        std::vector<uint64_t> seen;
+        for (auto& worker : workers) {
+            seen.push_back(worker->loopCount());
+            worker->wake();
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        for (size_t i = 0; i < workers.size(); i++) {
+            while (workers[i]->loopCount() == seen[i]) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    LOG_WARN("Worker {} did not pass a quiescent point, not freeing the old rules", i);
+                    retired.release();
+                    return;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    static void pinThread(std::thread& thread, int cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int rc = pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+        if (rc != 0) {
+            LOG_WARN("Failed to pin worker to CPU {}: {}", cpu, strerror(rc));
+        }
+    }
+};
+
+class ClientSession {
+public:
+    enum class ReadResult {
+        Line,
+        Timeout,
+        Closed
+    };
+
+    int socket;
+    RecvBuffer rx;
+    std::chrono::steady_clock::time_point last_used;
+
+    explicit ClientSession(int socket) : socket(socket), last_used(std::chrono::steady_clock::now()) {}
+
+    ClientSession(const ClientSession&) = delete;
+    ClientSession& operator=(const ClientSession&) = delete;
+
+    ~ClientSession() {
+        if (socket != -1) {
+            close(socket);
+        }
+    }
+
+    bool sendLine(const std::string& line) {
+        std::string message = line + "\n";
+        return send(socket, message.c_str(), message.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(message.length());
+    }
+
+    // The returned line stays valid until the next read on this session.
+    ReadResult readLine(std::string_view& line) {
+        while (!rx.nextLine(line)) {
+            ssize_t n = rx.fill(socket);
+            if (n > 0) {
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return ReadResult::Timeout;
+            }
+            line = rx.takeRemaining();
+            return line.empty() ? ReadResult::Closed : ReadResult::Line;
+        }
+        return ReadResult::Line;
+    }
+
+    // Like readLine() for a 2.0 session; an empty frame on Line means the
+    // stream is corrupt.
+    ReadResult readFrame(std::string_view& frame) {
+        while (!rx.nextFrame(frame, kMaxFrameSize)) {
+            ssize_t n = rx.fill(socket);
+            if (n > 0) {
+                continue;
+            }
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                return ReadResult::Timeout;
+            }
+            return ReadResult::Closed;
+        }
+        return ReadResult::Line;
+    }
+
+    bool sendBytes(const std::string& bytes) {
+        return send(socket, bytes.data(), bytes.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(bytes.size());
+    }
+
+    // True while the server has neither closed the session nor sent
+    // anything unsolicited on it.
+    bool isAlive() const {
+        pollfd pfd{socket, POLLIN, 0};
+        if (poll(&pfd, 1, 0) < 0) {
+            return false;
+        }
+        return pfd.revents == 0;
+    }
+};
+
+// Keeps handshaken sessions open between sales. Idle sessions are pinged
+// from a background thread so the server's idle timeout never closes them.
+class ConnectionPool {
+private:
+    size_t max_idle;
+    int keepalive_ms;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<std::unique_ptr<ClientSession>> idle;
+    std::thread keepalive_thread;
+    bool running;
+
+public:
+    ConnectionPool(size_t max_idle = 8, int keepalive_ms = 1000)
+        : max_idle(max_idle), keepalive_ms(keepalive_ms), running(false) {}
+
+    ~ConnectionPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        wake.notify_all();
+        if (keepalive_thread.joinable()) {
+            keepalive_thread.join();
+        }
+    }
+
+    std::unique_ptr<ClientSession> acquire() {
+        std::lock_guard<std::mutex> lock(mutex);
+        while (!idle.empty()) {
+            std::unique_ptr<ClientSession> session = std::move(idle.back());
+            idle.pop_back();
+            if (session->isAlive()) {
+                return session;
+            }
+        }
+        return nullptr;
+    }
+
+    void release(std::unique_ptr<ClientSession> session) {
+        session->last_used = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mutex);
+        if (idle.size() >= max_idle) {
+            return;
+        }
+        idle.push_back(std::move(session));
+        if (!running) {
+            running = true;
+            keepalive_thread = std::thread([this] { keepaliveLoop(); });
+        }
+    }
+
+private:
+    void keepaliveLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (running) {
+            wake.wait_for(lock, std::chrono::milliseconds(keepalive_ms));
+            if (!running) {
+                break;
+            }
+
+            auto cutoff = std::chrono::steady_clock::now() - std::chrono::milliseconds(keepalive_ms);
+            std::vector<std::unique_ptr<ClientSession>> due;
+            for (auto it = idle.begin(); it != idle.end();) {
+                if ((*it)->last_used <= cutoff) {
+                    due.push_back(std::move(*it));
+                    it = idle.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+
+            lock.unlock();
+            for (auto& session : due) {
+                if (!ping(*session)) {
+                    session.reset();
+                }
+            }
+            lock.lock();
+
+            for (auto& session : due) {
+                if (session && idle.size() < max_idle) {
+                    session->last_used = std::chrono::steady_clock::now();
+                    idle.push_back(std::move(session));
+                }
+            }
+        }
+    }
+
+    static bool ping(ClientSession& session) {
+        if (!session.isAlive() || !session.sendLine("PING")) {
+            return false;
+        }
+        std::string_view line;
+        return session.readLine(line) == ClientSession::ReadResult::Line && line == "PONG";
+    }
+};
+
+// One HELLO|GW|1.1 session carrying many AUTH requests at once. The
+// terminal answers them in any order and echoes each request's nonce, which
+// is used here to complete the matching future.
+class PipelinedSession {
+public:
+    // Called on the reader thread with the reply (without the nonce field),
+    // or with ok == false and the reason if the session was lost first.
+    // Replies of a binary (2.0) session are handed over in their text form.
+    using ReplyCallback = std::function<void(bool ok, const std::string& reply)>;
+
+private:
+    std::unique_ptr<ClientSession> session;
+    bool binary;
+    std::mutex mutex;
+    // Keyed by nonce, or on a binary session by the frame's request id bytes.
+    std::unordered_map<std::string, ReplyCallback> pending;
+    uint32_t next_request_id;
+    std::thread reader;
+    bool closed;
+
+public:
+    explicit PipelinedSession(std::unique_ptr<ClientSession> handshaken, bool binary = false)
+        : session(std::move(handshaken)), binary(binary), next_request_id(1), closed(false) {
+        setSocketTimeout(session->socket, 1000);
+        reader = std::thread([this] { readReplies(); });
+    }
+
+    PipelinedSession(const PipelinedSession&) = delete;
+    PipelinedSession& operator=(const PipelinedSession&) = delete;
+
+    ~PipelinedSession() {
+        shutdown(session->socket, SHUT_RDWR);
+        if (reader.joinable()) {
+            reader.join();
+        }
+    }
+
+    bool isClosed() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed;
+    }
+
+    void submitSale(const Money& amount, ReplyCallback callback) {
+        submitSale(amount, generateNonce(), getCurrentUnixTimestamp(), std::move(callback));
+    }
+
+    // Sends the sale with a caller-chosen nonce and timestamp, e.g. one
+    // captured offline.
+    void submitSale(const Money& amount, const std::string& nonce, long unix_ts, ReplyCallback callback) {
+        std::string auth_request;
+        if (!binary) {
+            auth_request = "AUTH|" + amount.toString() + "|" + std::to_string(unix_ts) + "|" + nonce;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        if (closed) {
+            lock.unlock();
+            callback(false, "Session closed");
+            return;
+        }
+        std::string key = nonce;
+        if (binary) {
+            appendAuthFrame(auth_request, next_request_id++, amount, unix_ts, nonce);
+            key = std::string(frameTag(auth_request));
+        }
+        auto [slot, inserted] = pending.try_emplace(key, std::move(callback));
+        if (!inserted) {
+            // Replies are matched by nonce, so a second AUTH with the nonce
+            // of one still in flight could never be told apart.
+            lock.unlock();
+            callback(false, "Nonce already in flight on this session");
+            return;
+        }
+        if (!(binary ? session->sendBytes(auth_request) : session->sendLine(auth_request))) {
+            ReplyCallback failed = std::move(slot->second);
+            pending.erase(slot);
+            lock.unlock();
+            failed(false, "Failed to send AUTH request");
+        }
+    }
+
+    // The future yields the terminal's reply without the nonce field, or
+    // throws if the session is lost before the reply arrives.
+    std::future<std::string> submitSale(const Money& amount) {
+        return submitSale(amount, generateNonce(), getCurrentUnixTimestamp());
+    }
+
+    std::future<std::string> submitSale(const Money& amount, const std::string& nonce, long unix_ts) {
+        auto promise = std::make_shared<std::promise<std::string>>();
+        std::future<std::string> result = promise->get_future();
+        submitSale(amount, nonce, unix_ts, [promise](bool ok, const std::string& reply) {
+            if (ok) {
+                promise->set_value(reply);
+            } else {
+                promise->set_exception(std::make_exception_ptr(std::runtime_error(reply)));
+            }
+        });
+        return result;
+    }
+
+private:
+    // Returns false once the session is closed or corrupt.
+    bool readFrameReply() {
+        std::string_view frame;
+        ClientSession::ReadResult result = session->readFrame(frame);
+        if (result == ClientSession::ReadResult::Closed || (result == ClientSession::ReadResult::Line && frame.empty())) {
+            return false;
+        }
+        if (result == ClientSession::ReadResult::Timeout) {
+            std::string ping;
+            appendPingFrame(ping, 0);
+            std::lock_guard<std::mutex> lock(mutex);
+            return session->sendBytes(ping);
+        }
+        if (frameType(frame) == FrameType::Pong) {
+            return true;
+        }
+
+        ReplyCallback callback;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = pending.find(std::string(frameTag(frame)));
+            if (it == pending.end()) {
+                std::cerr << "Reply for unknown request id " << loadLE<uint32_t>(frame.data() + 4) << std::endl;
+                return true;
+            }
+            callback = std::move(it->second);
+            pending.erase(it);
+        }
+        callback(true, replyFrameText(frame));
+        return true;
+    }
+
+    void readReplies() {
+        std::string_view line;
+        while (true) {
+            if (binary) {
+                if (!readFrameReply()) {
+                    break;
+                }
+                continue;
+            }
+            ClientSession::ReadResult result = session->readLine(line);
+            if (result == ClientSession::ReadResult::Closed) {
+                break;
+            }
+            if (result == ClientSession::ReadResult::Timeout) {
+                // Keeps the terminal's idle timeout from closing the session.
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!session->sendLine("PING")) {
+                    break;
+                }
+                continue;
+            }
+            if (line == "PONG") {
+                continue;
+            }
+
+            size_t bar = line.rfind('|');
+            if (bar == std::string_view::npos) {
+                std::cerr << "Uncorrelated reply: " << line << std::endl;
+                continue;
+            }
+
+            ReplyCallback callback;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                auto it = pending.find(std::string(line.substr(bar + 1)));
+                if (it == pending.end()) {
+                    std::cerr << "Reply for unknown nonce: " << line << std::endl;
+                    continue;
+                }
+                callback = std::move(it->second);
+                pending.erase(it);
+            }
+            callback(true, std::string(line.substr(0, bar)));
+        }
+
+        std::unordered_map<std::string, ReplyCallback> lost;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+            lost.swap(pending);
+        }
+        for (auto& entry : lost) {
+            entry.second(false, "Connection closed by server");
+        }
+    }
+};
+
+// Walks a file of sales line by line through a read-only mapping, so a
+// day's worth of offline captures never has to fit in memory: pages are
+// read ahead sequentially and dropped again once the cursor has passed.
+class MappedLineReader {
+    static constexpr size_t kReleaseChunk = 64 << 20;
+
+    int fd;
+    const char* data;
+    size_t size;
+    size_t offset;
+    size_t released;
+
+public:
+    MappedLineReader() : fd(-1), data(nullptr), size(0), offset(0), released(0) {}
+
+    MappedLineReader(const MappedLineReader&) = delete;
+    MappedLineReader& operator=(const MappedLineReader&) = delete;
+
+    ~MappedLineReader() {
+        if (data) {
+            munmap(const_cast<char*>(data), size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    bool open(const std::string& path) {
+        fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        size = static_cast<size_t>(st.st_size);
+        if (size == 0) {
+            return true;
+        }
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            size = 0;
+            return false;
+        }
+        data = static_cast<const char*>(map);
+        madvise(map, size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    // Yields the next line without its terminator (and any trailing '\r');
+    // false at end of file.
+    bool nextLine(std::string_view& line) {
+        if (offset >= size) {
+            return false;
+        }
+        const char* start = data + offset;
+        const char* newline = static_cast<const char*>(memchr(start, '\n', size - offset));
+        size_t length = newline ? static_cast<size_t>(newline - start) : size - offset;
+        offset += length + (newline ? 1 : 0);
+        if (length > 0 && start[length - 1] == '\r') {
+            length--;
+        }
+        line = std::string_view(start, length);
+
+        if (offset - released >= kReleaseChunk) {
+            size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+            size_t upto = (offset - released) / page * page;
+            madvise(const_cast<char*>(data) + released, upto, MADV_DONTNEED);
+            released += upto;
+        }
+        return true;
+    }
+};
+
+// One line of a sale file: "<amount>[,<nonce>[,<unix_ts>]]". A missing
+// nonce or timestamp is generated when the sale is sent.
+struct SaleFileEntry {
+    size_t line = 0;
+    Money amount;
+    std::string nonce;
+    long unix_ts = 0;
+};
+
+// Fills entry from a data line; false with a reason if it is malformed.
+bool parseSaleFileLine(std::string_view text, SaleFileEntry& entry, std::string& error) {
+    std::string_view fields[3];
+    size_t count = 0;
+    while (true) {
+        size_t comma = text.find(',');
+        if (count == 3) {
+            error = "too many fields";
+            return false;
+        }
+        fields[count++] = text.substr(0, comma);
+        if (comma == std::string_view::npos) {
+            break;
+        }
+        text.remove_prefix(comma + 1);
+    }
+
+    if (!Money::parse(fields[0], entry.amount) || entry.amount.minor <= 0) {
+        error = "invalid amount";
+        return false;
+    }
+    entry.nonce.assign(fields[1].data(), fields[1].size());
+    if (!entry.nonce.empty() && (entry.nonce.size() < 8 || entry.nonce.size() > 16)) {
+        error = "nonce must be 8 to 16 characters";
+        return false;
+    }
+    if (!std::all_of(entry.nonce.begin(), entry.nonce.end(), isHexDigit)) {
+        error = "nonce must be hexadecimal";
+        return false;
+    }
+    entry.unix_ts = 0;
+    if (!fields[2].empty()) {
+        auto result = std::from_chars(fields[2].data(), fields[2].data() + fields[2].size(), entry.unix_ts);
+        if (result.ec != std::errc() || result.ptr != fields[2].data() + fields[2].size() || entry.unix_ts <= 0) {
+            error = "invalid timestamp";
+            return false;
+        }
+    }
+    return true;
+}
+
+class POSGatewayClient {
+public:
+    // Waits for reply lines on a session with poll(). A single absolute
+    // deadline bounds the whole wait, and a PING goes out whenever the
+    // session has been silent for ping_interval; the next wakeup is always
+    // the earlier of the two, so a reply is picked up as soon as it arrives.
+    class ReplyWaiter {
+    public:
+        enum class Outcome {
+            Line,
+            PingSent,
+            TimedOut,
+            Closed
+        };
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        ClientSession& session;
+        std::chrono::milliseconds ping_interval;
+        Clock::time_point deadline;
+        Clock::time_point next_ping;
+
+    public:
+        ReplyWaiter(ClientSession& session, std::chrono::milliseconds ping_interval,
+                    std::chrono::milliseconds timeout)
+            : session(session), ping_interval(ping_interval) {
+            auto now = Clock::now();
+            deadline = now + timeout;
+            next_ping = now + ping_interval;
+        }
+
+        Outcome next(std::string_view& line) {
+            while (!session.rx.nextLine(line)) {
+                auto now = Clock::now();
+                if (now >= deadline) {
+                    return Outcome::TimedOut;
+                }
+                if (now >= next_ping) {
+                    next_ping = now + ping_interval;
+                    return session.sendLine("PING") ? Outcome::PingSent : Outcome::Closed;
+                }
+
+                auto wake = std::min(deadline, next_ping);
+                auto wait_ms = std::chrono::ceil<std::chrono::milliseconds>(wake - now).count();
+                pollfd pfd{session.socket, POLLIN, 0};
+                int ready = poll(&pfd, 1, static_cast<int>(wait_ms));
+                if (ready < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return Outcome::Closed;
+                }
+                if (ready == 0) {
+                    continue;
+                }
+
+                ssize_t n = session.rx.fill(session.socket);
+                if (n > 0) {
+                    next_ping = Clock::now() + ping_interval;
+                    continue;
+                }
+                if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                    continue;
+                }
+                line = session.rx.takeRemaining();
+                return line.empty() ? Outcome::Closed : Outcome::Line;
+            }
+            return Outcome::Line;
+        }
+    };
+
+private:
+    static constexpr int kPingIntervalMs = 3000;
+    static constexpr int kResponseTimeoutMs = 15000;
+
+    std::string host;
+    int port;
+    std::string unix_path;
+    bool verbose;
+    bool binary;
+    ConnectionPool pool;
+
+    int createConnectedSocket(int timeout_ms = 2000) {
+        if (!unix_path.empty()) {
+            return createUnixSocket(timeout_ms);
+        }
+
+        int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_socket == -1) {
+            return -1;
+        }
+
+        setSocketTimeout(client_socket, timeout_ms);
+
+        sockaddr_in server_addr{};
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_port = htons(port);
+        
+        if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) <= 0) {
+            close(client_socket);
+            return -1;
+        }
+
+        if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(client_socket);
+            return -1;
+        }
+
+        return client_socket;
+    }
+
+    int createUnixSocket(int timeout_ms) {
+        sockaddr_un server_addr{};
+        if (unix_path.size() >= sizeof(server_addr.sun_path)) {
+            return -1;
+        }
+        server_addr.sun_family = AF_UNIX;
+        memcpy(server_addr.sun_path, unix_path.c_str(), unix_path.size() + 1);
+
+        int client_socket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (client_socket == -1) {
+            return -1;
+        }
+
+        setSocketTimeout(client_socket, timeout_ms);
+
+        if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            close(client_socket);
+            return -1;
+        }
+
+        return client_socket;
+    }
+
+    bool performHandshake(ClientSession& session, const char* version = "1.0") {
+        std::string hello = std::string("HELLO|GW|") + version;
+        if (!session.sendLine(hello)) {
+            return false;
+        }
+        if (verbose) {
+            std::cout << "Sent: " << hello << std::endl;
+        }
+
+        std::string_view response;
+        session.readLine(response);
+        if (verbose) {
+            std::cout << "Received: " << response << std::endl;
+        }
+
+        return response == std::string("HELLO|TERM|") + version;
+    }
+
+public:
+    POSGatewayClient(const std::string& host, int port) : host(host), port(port), verbose(true), binary(false) {}
+
+    // Connects over the Unix socket at unix_path instead of TCP.
+    explicit POSGatewayClient(const std::string& unix_path)
+        : port(0), unix_path(unix_path), verbose(true), binary(false) {}
+
+    void setVerbose(bool enabled) {
+        verbose = enabled;
+    }
+
+    // Makes openPipeline() negotiate the binary 2.0 framing instead of 1.1.
+    void setBinaryFraming(bool enabled) {
+        binary = enabled;
+    }
+
+    // Opens a dedicated 1.1 (or 2.0) session for pipelined sales; nullptr
+    // if the terminal cannot be reached or does not speak that version.
+    std::unique_ptr<PipelinedSession> openPipeline() {
+        int client_socket = createConnectedSocket(3000);
+        if (client_socket == -1) {
+            std::cerr << "Connection failed to " << host << ":" << port << std::endl;
+            return nullptr;
+        }
+        auto session = std::make_unique<ClientSession>(client_socket);
+        if (!performHandshake(*session, binary ? "2.0" : "1.1")) {
+            std::cerr << "Handshake failed" << std::endl;
+            return nullptr;
+        }
+        return std::make_unique<PipelinedSession>(std::move(session), binary);
+    }
+
+    // Sends count sales over one pipelined session with at most depth of
+    // them in flight at a time.
+    bool sendPipelinedSales(const Money& amount, int count, int depth) {
+        std::unique_ptr<PipelinedSession> pipeline = openPipeline();
+        if (!pipeline) {
+            return false;
+        }
+
+        bool all_ok = true;
+        std::deque<std::future<std::string>> in_flight;
+        int submitted = 0;
+        while (submitted < count || !in_flight.empty()) {
+            while (submitted < count && static_cast<int>(in_flight.size()) < depth) {
+                in_flight.push_back(pipeline->submitSale(amount));
+                submitted++;
+            }
+            try {
+                std::cout << "Payment gateway response: " << in_flight.front().get() << std::endl;
+            } catch (const std::exception& e) {
+                std::cerr << "Transaction failed: " << e.what() << std::endl;
+                all_ok = false;
+            }
+            in_flight.pop_front();
+        }
+        return all_ok;
+    }
+
+    // Sends every sale in a file over `sessions` pipelined sessions with up
+    // to depth requests in flight on each, and writes one CSV result row
+    // per input line, in input order. Only the in-flight window is held in
+    // memory. The nonce and timestamp actually sent are written back, so
+    // re-running the failed rows is answered from the terminal's replay
+    // cache instead of authorizing twice.
+    bool sendSalesFromFile(const std::string& path, const std::string& result_path, int sessions, int depth) {
+        MappedLineReader reader;
+        if (!reader.open(path)) {
+            std::cerr << "Failed to open " << path << ": " << strerror(errno) << std::endl;
+            return false;
+        }
+        std::ofstream results(result_path, std::ios::trunc);
+        if (!results) {
+            std::cerr << "Failed to create " << result_path << std::endl;
+            return false;
+        }
+
+        std::vector<std::unique_ptr<PipelinedSession>> pipelines;
+        for (int i = 0; i < sessions; i++) {
+            pipelines.push_back(openPipeline());
+            if (!pipelines.back()) {
+                return false;
+            }
+        }
+
+        // A line in the result window. Lines settled without a reply
+        // (invalid, or no session) carry their outcome in status/detail
+        // and wait their turn like the rest, so rows stay in input order.
+        struct InFlightSale {
+            SaleFileEntry entry;
+            size_t session;
+            std::future<std::string> reply;
+            const char* status;
+            std::string detail;
+        };
+        std::deque<InFlightSale> in_flight;
+        // Nonces of the sales in the window. A line repeating one would
+        // only get the earlier sale's reply, so it fails instead.
+        std::unordered_set<std::string> in_flight_nonces;
+        size_t window = static_cast<size_t>(sessions) * depth;
+        size_t next_session = 0;
+        uint64_t approved = 0, declined = 0, failed = 0, invalid = 0;
+
+        results << "line,amount,nonce,unix_ts,status,auth_code,rrn,detail\n";
+        auto writeRow = [&](const SaleFileEntry& entry, const std::string& status, const std::string& auth_code,
+                            const std::string& rrn, const std::string& detail) {
+            results << entry.line << ',' << entry.amount.toString() << ',' << entry.nonce << ',';
+            if (entry.unix_ts > 0) {
+                results << entry.unix_ts;
+            }
+            results << ',' << status << ',' << auth_code << ',' << rrn << ',' << csvField(detail) << '\n';
+        };
+
+        // Waits for the oldest sale and records its outcome.
+        auto completeOldest = [&] {
+            InFlightSale& sale = in_flight.front();
+            if (!sale.reply.valid()) {
+                if (std::string_view(sale.status) == "INVALID") {
+                    results << sale.entry.line << ",,,," << sale.status << ",,," << csvField(sale.detail) << '\n';
+                    invalid++;
+                } else {
+                    writeRow(sale.entry, sale.status, "", "", sale.detail);
+                    failed++;
+                }
+                in_flight.pop_front();
+                return;
+            }
+            in_flight_nonces.erase(sale.entry.nonce);
+            try {
+                std::string reply = sale.reply.get();
+                std::vector<std::string> fields;
+                std::stringstream ss(reply);
+                std::string field;
+                while (std::getline(ss, field, '|')) {
+                    fields.push_back(field);
+                }
+                if (fields.size() == 4 && fields[0] == "APPROVED") {
+                    writeRow(sale.entry, fields[0], fields[1], fields[3], "");
+                    approved++;
+                } else {
+                    size_t bar = reply.find('|');
+                    writeRow(sale.entry, reply.substr(0, bar), "", "",
+                             bar == std::string::npos ? "" : reply.substr(bar + 1));
+                    declined++;
+                }
+            } catch (const std::exception& e) {
+                writeRow(sale.entry, "ERROR", "", "", e.what());
+                failed++;
+                // The reader has already failed everything else pending on
+                // the lost session; later sales go out on a fresh one.
+                std::unique_ptr<PipelinedSession>& pipeline = pipelines[sale.session];
+                if (pipeline && pipeline->isClosed()) {
+                    pipeline = openPipeline();
+                }
+            }
+            in_flight.pop_front();
+        };
+
+        std::string_view text;
+        size_t line_number = 0;
+        while (reader.nextLine(text)) {
+            line_number++;
+            if (text.empty() || text.front() == '#' || (line_number == 1 && text.compare(0, 6, "amount") == 0)) {
+                continue;
+            }
+
+            if (in_flight.size() >= window) {
+                completeOldest();
+            }
+
+            SaleFileEntry entry;
+            entry.line = line_number;
+            std::string error;
+            if (!parseSaleFileLine(text, entry, error)) {
+                in_flight.push_back({std::move(entry), 0, {}, "INVALID", std::move(error)});
+                continue;
+            }
+            if (entry.nonce.empty()) {
+                entry.nonce = generateNonce();
+            }
+            if (entry.unix_ts == 0) {
+                entry.unix_ts = getCurrentUnixTimestamp();
+            }
+            if (!in_flight_nonces.insert(entry.nonce).second) {
+                in_flight.push_back({std::move(entry), 0, {}, "ERROR", "Nonce already in flight"});
+                continue;
+            }
+
+            // Round-robin over the sessions that are still usable.
+            size_t session = next_session;
+            for (size_t tried = 0; tried < pipelines.size() && !pipelines[session]; tried++) {
+                session = (session + 1) % pipelines.size();
+            }
+            next_session = (session + 1) % pipelines.size();
+            if (!pipelines[session]) {
+                in_flight_nonces.erase(entry.nonce);
+                in_flight.push_back({std::move(entry), session, {}, "ERROR", "No session to the terminal"});
+                continue;
+            }
+            std::future<std::string> reply = pipelines[session]->submitSale(entry.amount, entry.nonce, entry.unix_ts);
+            in_flight.push_back({std::move(entry), session, std::move(reply), nullptr, ""});
+        }
+        while (!in_flight.empty()) {
+            completeOldest();
+        }
+
+        results.flush();
+        std::cout << "Sent " << (approved + declined + failed) << " sale(s) from " << path << ": " << approved
+                  << " approved, " << declined << " declined, " << failed << " failed";
+        if (invalid > 0) {
+            std::cout << ", " << invalid << " invalid line(s) skipped";
+        }
+        std::cout << "; results in " << result_path << std::endl;
+        return static_cast<bool>(results) && failed == 0 && invalid == 0;
+    }
+
+    bool sendSaleRequest(const Money& amount) {
+        int retries = 0;
+        const int max_retries = 2;
+
+        long unix_ts = getCurrentUnixTimestamp();
+        std::string nonce = generateNonce();
+        
+        while (retries <= max_retries) {
+            std::unique_ptr<ClientSession> session = pool.acquire();
+            bool reused = session != nullptr;
+
+            if (reused) {
+                std::cout << "Reusing pooled session" << std::endl;
+            } else {
+                int client_socket = createConnectedSocket();
+                if (client_socket == -1) {
+                    std::cerr << "Connection failed to " << host << ":" << port;
+                    if (retries < max_retries) {
+                        int delay_ms = 200 * (1 << retries); 
+                        std::cerr << ", retrying in " << delay_ms << "ms..." << std::endl;
+                        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+                        retries++;
+                        continue;
+                    } else {
+                        std::cerr << ", giving up after " << max_retries << " retries" << std::endl;
+                        return false;
                     }
-                    std::cout << "Sent: PONG" << std::endl;
-                    continue;
                 }
 
-                if (request.substr(0, 5) == "AUTH|") {
-                    std::string response = processAuthRequest(request);
-                    if (!sendLine(client_socket, response)) {
-                        std::cerr << "Failed to send response" << std::endl;
+                setSocketTimeout(client_socket, 3000); 
+                session = std::make_unique<ClientSession>(client_socket);
+            }
+
+            bool success = false;
+            bool got_reply = false;
+            try {
+                if (!reused && !performHandshake(*session)) {
+                    std::cerr << "Handshake failed" << std::endl;
+                    
+                    if (retries == 0) {
+                        std::cout << "Server dropped connection after HELLO, retrying..." << std::endl;
+                        retries++;
+                        continue;
+                    } else {
+                        return false;
+                    }
+                }
+
+                std::ostringstream auth_request;
+                auth_request << "AUTH|" << amount.toString() << "|" << unix_ts << "|" << nonce;
+                
+                if (!session->sendLine(auth_request.str())) {
+                    std::cerr << "Failed to send AUTH request" << std::endl;
+                    if (reused) {
+                        continue;
+                    }
+                    return false;
+                }
+
+                std::cout << "Sent: " << auth_request.str() << std::endl;
+
+                ReplyWaiter waiter(*session, std::chrono::milliseconds(kPingIntervalMs),
+                                   std::chrono::milliseconds(kResponseTimeoutMs));
+                std::string_view response;
+
+                while (true) {
+                    ReplyWaiter::Outcome outcome = waiter.next(response);
+                    if (outcome == ReplyWaiter::Outcome::PingSent) {
+                        std::cout << "Sent: PING" << std::endl;
+                        continue;
+                    }
+                    if (outcome == ReplyWaiter::Outcome::TimedOut) {
+                        std::cerr << "No response within " << kResponseTimeoutMs << "ms" << std::endl;
                         break;
                     }
-                    std::cout << "Sent: " << response << std::endl;
-                } else {
-                    std::string response = "DECLINED|Invalid request format";
-                    if (!sendLine(client_socket, response)) {
-                        std::cerr << "Failed to send error response" << std::endl;
+                    if (outcome == ReplyWaiter::Outcome::Closed) {
+                        std::cerr << "Connection closed by server" << std::endl;
                         break;
                     }
-                    std::cout << "Sent: " << response << std::endl;
+
+                    got_reply = true;
+                    if (response == "PONG") {
+                        std::cout << "Received: PONG" << std::endl;
+                        continue;
+                    }
+                    std::cout << "Payment gateway response: " << response << std::endl;
+                    success = true;
+                    break;
+                }
+
+            } catch (const std::exception& e) {
+                std::cerr << "Exception during transaction: " << e.what() << std::endl;
+            }
+
+            if (success) {
+                pool.release(std::move(session));
+                return true;
+            }
+            session.reset();
+
+            if (reused && !got_reply) {
+                std::cout << "Pooled session went stale, reconnecting..." << std::endl;
+                continue;
+            }
+            
+            if (retries < max_retries) {
+                int delay_ms = 200 * (1 << retries); 
+                std::cout << "Transaction failed, retrying in " << delay_ms << "ms..." << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+                retries++;
+            } else {
+                std::cerr << "Transaction failed after " << max_retries << " retries" << std::endl;
+                return false;
+            }
+        }
+        
+        return false;
+    }
+};
+
+bool parseCpuList(const std::string& value, std::vector<int>& cpus) {
+    cpus.clear();
+    if (value == "auto") {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+            return false;
+        }
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+        return !cpus.empty();
+    }
+
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        try {
+            int cpu = std::stoi(item);
+            if (cpu < 0 || cpu >= CPU_SETSIZE) {
+                return false;
+            }
+            cpus.push_back(cpu);
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return !cpus.empty();
+}
+
+bool parseAuthRequestLegacy(const std::string& request, double& amount, long& unix_ts, std::string& nonce) {
+    std::vector<std::string> parts;
+    std::stringstream ss(request);
+    std::string part;
+    while (std::getline(ss, part, '|')) {
+        parts.push_back(part);
+    }
+    if (parts.size() != 4 || parts[0] != "AUTH") {
+        return false;
+    }
+    try {
+        amount = std::stod(parts[1]);
+        unix_ts = std::stol(parts[2]);
+    } catch (const std::exception&) {
+        return false;
+    }
+    nonce = parts[3];
+    if (nonce.length() < 8 || nonce.length() > 16) {
+        return false;
+    }
+    for (char c : nonce) {
+        if (!std::isxdigit(c)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Fn>
+double measureNsPerOp(long iterations, Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < iterations; i++) {
+        fn(i);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+int runParseMicrobench(long iterations) {
+    const std::string lines[] = {
+        "AUTH|12.34|1700000000|DEADBEEF",
+        "AUTH|75.00|1700000001|0123456789ABCDEF",
+        "AUTH|0.99|1700000002|A1B2C3D4E5",
+        "AUTH|50.50|1700000003|ffffffffffff",
+    };
+    const size_t line_count = sizeof(lines) / sizeof(lines[0]);
+
+    volatile int64_t sink = 0;
+    double legacy_ns = measureNsPerOp(iterations, [&](long i) {
+        double amount;
+        long unix_ts;
+        std::string nonce;
+        if (parseAuthRequestLegacy(lines[i % line_count], amount, unix_ts, nonce)) {
+            sink = sink + unix_ts + static_cast<int64_t>(amount) + static_cast<int64_t>(nonce.size());
+        }
+    });
+    double fast_ns = measureNsPerOp(iterations, [&](long i) {
+        AuthRequest request;
+        if (parseAuthRequest(lines[i % line_count], request) == AuthParseError::None) {
+            sink = sink + request.unix_ts + request.amount.minor + request.nonce_len;
+        }
+    });
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "AUTH parse (" << iterations << " iterations)" << std::endl;
+    std::cout << "  stringstream/stod: " << legacy_ns << " ns/request" << std::endl;
+    std::cout << "  from_chars/view:   " << fast_ns << " ns/request" << std::endl;
+    std::cout << "  speedup:           " << legacy_ns / fast_ns << "x" << std::endl;
+    return 0;
+}
+
+int runIdMicrobench(long iterations, int threads) {
+    std::vector<std::vector<std::string>> rrns(threads);
+    std::vector<double> nonce_rate(threads), auth_rate(threads), rrn_rate(threads);
+    std::vector<std::thread> workers;
+
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            volatile size_t sink = 0;
+            auto rate = [&](auto&& fn) {
+                double ns = measureNsPerOp(iterations, fn);
+                return 1e9 / ns;
+            };
+            nonce_rate[t] = rate([&](long) { sink = sink + IdGenerator::nonce().size(); });
+            auth_rate[t] = rate([&](long) { sink = sink + IdGenerator::authCode().size(); });
+            rrns[t].reserve(iterations);
+            rrn_rate[t] = rate([&](long) { rrns[t].push_back(IdGenerator::rrn()); });
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    std::vector<std::string> all;
+    for (auto& list : rrns) {
+        all.insert(all.end(), list.begin(), list.end());
+    }
+    std::sort(all.begin(), all.end());
+    size_t duplicates = 0;
+    for (size_t i = 1; i < all.size(); i++) {
+        if (all[i] == all[i - 1]) {
+            duplicates++;
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(0);
+    std::cout << "ID generation (" << threads << " thread(s), " << iterations << " IDs each)" << std::endl;
+    for (int t = 0; t < threads; t++) {
+        std::cout << "  thread " << t << ": nonce " << nonce_rate[t] << "/s, auth code " << auth_rate[t]
+                  << "/s, rrn " << rrn_rate[t] << "/s" << std::endl;
+    }
+    std::cout << "  RRN uniqueness: " << all.size() << " generated, " << duplicates << " duplicate(s)" << std::endl;
+    return duplicates == 0 ? 0 : 1;
+}
+
+int runReplayMicrobench(long iterations) {
+    const int64_t now = getCurrentUnixTimestamp();
+    size_t entries = static_cast<size_t>(std::min<long>(iterations, 1000000));
+    ReplayCache cache(entries * 3, 300);
+    const Reply approval = Reply::approved("123456", "****-****-****-1234", "123456789012");
+
+    std::vector<std::string> nonces;
+    nonces.reserve(entries);
+    for (size_t i = 0; i < entries; i++) {
+        char buffer[17];
+        snprintf(buffer, sizeof(buffer), "%016llX", static_cast<unsigned long long>(IdGenerator::next()));
+        nonces.emplace_back(buffer);
+    }
+
+    Reply cached;
+    double insert_ns = measureNsPerOp(entries, [&](long i) {
+        if (cache.begin(nonces[i], now, now, cached) == ReplayStatus::New) {
+            cache.finish(nonces[i], now, approval);
+        }
+    });
+    double hit_ns = measureNsPerOp(iterations, [&](long i) {
+        cache.begin(nonces[i % entries], now, now, cached);
+    });
+    double miss_ns = measureNsPerOp(entries, [&](long i) {
+        std::string_view nonce = nonces[i];
+        cache.begin(nonce.substr(0, 12), now, now, cached);
+    });
+
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Replay cache (" << entries << " entries, capacity " << cache.capacity() << ")" << std::endl;
+    std::cout << "  begin+finish (new):   " << insert_ns << " ns" << std::endl;
+    std::cout << "  lookup (duplicate):   " << hit_ns << " ns" << std::endl;
+    std::cout << "  lookup+claim (miss):  " << miss_ns << " ns" << std::endl;
+    std::cout << "  memory per slot:      " << sizeof(ReplayCache::Entry) << " bytes ("
+              << sizeof(ReplayCache::Entry) * 4 / 3 << " bytes per entry at the 75% load limit)" << std::endl;
+    return 0;
+}
+
+int runMicrobench(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::cerr << "Microbenchmark target is required (parse, ids, replay)" << std::endl;
+        return 1;
+    }
+
+    std::string target = argv[2];
+    long iterations = 1000000;
+    int threads = 1;
+
+    for (int i = 3; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for option: " << argv[i] << std::endl;
+            return 1;
+        }
+
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+
+        if (option == "--iterations") {
+            iterations = std::stol(value);
+            if (iterations <= 0) {
+                std::cerr << "Number of iterations must be positive" << std::endl;
+                return 1;
+            }
+        } else if (option == "--threads") {
+            threads = std::stoi(value);
+            if (threads <= 0 || threads > static_cast<int>(IdGenerator::kRrnSlots)) {
+                std::cerr << "Number of threads must be between 1 and " << IdGenerator::kRrnSlots << std::endl;
+                return 1;
+            }
+        } else {
+            std::cerr << "Unknown option for microbench command: " << option << std::endl;
+            return 1;
+        }
+    }
+
+    if (target == "parse") {
+        return runParseMicrobench(iterations);
+    }
+    if (target == "ids") {
+        return runIdMicrobench(iterations, threads);
+    }
+    if (target == "replay") {
+        return runReplayMicrobench(iterations);
+    }
+
+    std::cerr << "Unknown microbenchmark: " << target << std::endl;
+    return 1;
+}
+
+struct BenchOptions {
+    std::string host;
+    int port = 0;
+    std::string unix_path;
+    bool binary = false;
+    bool open_loop = false;
+    int connections = 8;
+    double rate = 0.0;
+    int duration_s = 10;
+    double approve_ratio = 0.9;
+    std::string csv_path;
+    std::string json_path;
+};
+
+struct BenchStats {
+    LatencyHistogram latency_us;
+    uint64_t approved = 0;
+    uint64_t declined = 0;
+
+    void record(const std::string& reply, std::chrono::steady_clock::time_point since) {
+        auto elapsed = std::chrono::steady_clock::now() - since;
+        latency_us.record(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+        if (reply.compare(0, 9, "APPROVED|") == 0) {
+            approved++;
+        } else {
+            declined++;
+        }
+    }
+};
+
+// Draws an amount on the approving side of the $50.50 limit with
+// probability approve_ratio and on the declining side otherwise.
+Money benchAmount(double approve_ratio) {
+    double unit = (IdGenerator::next() >> 11) * 0x1.0p-53;
+    if (unit < approve_ratio) {
+        return Money::fromMinor(100 + IdGenerator::uniform(4950));
+    }
+    return Money::fromMinor(5050 + IdGenerator::uniform(4950));
+}
+
+// N connections, each with one request outstanding at a time.
+void runClosedLoop(POSGatewayClient& client, const BenchOptions& options, std::vector<BenchStats>& stats,
+                   std::atomic<uint64_t>& errors) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(options.duration_s);
+    std::vector<std::thread> threads;
+
+    for (int c = 0; c < options.connections; c++) {
+        threads.emplace_back([&, c] {
+            std::unique_ptr<PipelinedSession> pipeline = client.openPipeline();
+            while (pipeline && std::chrono::steady_clock::now() < deadline) {
+                auto sent = std::chrono::steady_clock::now();
+                try {
+                    stats[c].record(pipeline->submitSale(benchAmount(options.approve_ratio)).get(), sent);
+                } catch (const std::exception&) {
+                    errors++;
+                    pipeline = client.openPipeline();
                 }
             }
-        } catch (const std::exception& e) {
-            std::cerr << "Exception in handleClient: " << e.what() << std::endl;
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Requests go out on a fixed schedule regardless of how fast replies come
+// back, and latency is measured from the scheduled send time, so a stalled
+// server shows up in the percentiles instead of slowing the generator down.
+void runOpenLoop(POSGatewayClient& client, const BenchOptions& options, std::vector<BenchStats>& stats,
+                 std::atomic<uint64_t>& errors) {
+    std::vector<std::unique_ptr<PipelinedSession>> pipelines;
+    for (int c = 0; c < options.connections; c++) {
+        pipelines.push_back(client.openPipeline());
+        if (!pipelines.back()) {
+            errors++;
+            return;
         }
+    }
+
+    std::atomic<int64_t> outstanding{0};
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::duration<double>(1.0 / options.rate);
+    uint64_t total = static_cast<uint64_t>(options.rate * options.duration_s);
+
+    for (uint64_t i = 0; i < total; i++) {
+        auto scheduled = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval * i);
+        std::this_thread::sleep_until(scheduled);
+
+        size_t c = i % pipelines.size();
+        outstanding++;
+        pipelines[c]->submitSale(benchAmount(options.approve_ratio),
+                                 [&, c, scheduled](bool ok, const std::string& reply) {
+            if (ok) {
+                stats[c].record(reply, scheduled);
+            } else {
+                errors++;
+            }
+            outstanding--;
+        });
+    }
+
+    auto drain_deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (outstanding.load() > 0 && std::chrono::steady_clock::now() < drain_deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    pipelines.clear();
+}
+
+// One measured pass over a single transport.
+struct BenchRun {
+    const char* transport;
+    BenchStats total;
+    uint64_t errors = 0;
+    double throughput = 0.0;
+};
+
+bool appendBenchCsv(const std::string& path, const BenchOptions& options, const BenchRun& run) {
+    bool write_header;
+    {
+        std::ifstream existing(path);
+        write_header = !existing.good() || existing.peek() == std::ifstream::traits_type::eof();
+    }
+    std::ofstream out(path, std::ios::app);
+    if (!out) {
+        return false;
+    }
+    const LatencyHistogram& h = run.total.latency_us;
+    if (write_header) {
+        out << "mode,connections,target_rps,duration_s,approve_ratio,requests,approved,declined,errors,"
+               "throughput_rps,mean_us,p50_us,p90_us,p99_us,p999_us,max_us,transport,protocol\n";
+    }
+    out << (options.open_loop ? "open" : "closed") << ',' << options.connections << ',' << options.rate << ','
+        << options.duration_s << ',' << options.approve_ratio << ',' << h.count() << ',' << run.total.approved << ','
+        << run.total.declined << ',' << run.errors << ',' << run.throughput << ',' << h.mean() << ','
+        << h.percentile(50) << ',' << h.percentile(90) << ',' << h.percentile(99) << ',' << h.percentile(99.9) << ','
+        << h.max() << ',' << run.transport << ',' << (options.binary ? "binary" : "text") << '\n';
+    return static_cast<bool>(out);
+}
+
+void writeBenchRunJson(std::ostream& out, const BenchOptions& options, const BenchRun& run, const char* indent) {
+    const LatencyHistogram& h = run.total.latency_us;
+    out << indent << "{\n"
+        << indent << "  \"transport\": \"" << run.transport << "\",\n"
+        << indent << "  \"protocol\": \"" << (options.binary ? "binary" : "text") << "\",\n"
+        << indent << "  \"mode\": \"" << (options.open_loop ? "open" : "closed") << "\",\n"
+        << indent << "  \"connections\": " << options.connections << ",\n"
+        << indent << "  \"target_rps\": " << options.rate << ",\n"
+        << indent << "  \"duration_s\": " << options.duration_s << ",\n"
+        << indent << "  \"approve_ratio\": " << options.approve_ratio << ",\n"
+        << indent << "  \"requests\": " << h.count() << ",\n"
+        << indent << "  \"approved\": " << run.total.approved << ",\n"
+        << indent << "  \"declined\": " << run.total.declined << ",\n"
+        << indent << "  \"errors\": " << run.errors << ",\n"
+        << indent << "  \"throughput_rps\": " << run.throughput << ",\n"
+        << indent << "  \"latency_us\": {\"mean\": " << h.mean() << ", \"p50\": " << h.percentile(50)
+        << ", \"p90\": " << h.percentile(90) << ", \"p99\": " << h.percentile(99)
+        << ", \"p99.9\": " << h.percentile(99.9) << ", \"max\": " << h.max() << "}\n"
+        << indent << "}";
+}
+
+// A single run is written as one object; a TCP/Unix comparison as an
+// array of both.
+bool writeBenchJson(const std::string& path, const BenchOptions& options, const std::vector<BenchRun>& runs) {
+    std::ofstream out(path);
+    if (!out) {
+        return false;
+    }
+    if (runs.size() == 1) {
+        writeBenchRunJson(out, options, runs.front(), "");
+        out << "\n";
+        return static_cast<bool>(out);
+    }
+    out << "[\n";
+    for (size_t i = 0; i < runs.size(); i++) {
+        writeBenchRunJson(out, options, runs[i], "  ");
+        out << (i + 1 < runs.size() ? ",\n" : "\n");
+    }
+    out << "]\n";
+    return static_cast<bool>(out);
+}
 
-        close(client_socket);
-        std::cout << "Client disconnected" << std::endl;
+BenchRun runBenchPass(POSGatewayClient& client, const BenchOptions& options, const char* transport) {
+    std::vector<BenchStats> stats(options.connections);
+    std::atomic<uint64_t> errors{0};
+    auto start = std::chrono::steady_clock::now();
+    if (options.open_loop) {
+        runOpenLoop(client, options, stats, errors);
+    } else {
+        runClosedLoop(client, options, stats, errors);
     }
+    double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
 
-    std::string processAuthRequest(const std::string& request) {
-        try {
-            std::cout << "Processing AUTH request: " << request << std::endl;
-            
-            std::vector<std::string> parts;
-            std::stringstream ss(request);
-            std::string part;
-            
-            while (std::getline(ss, part, '|')) {
-                parts.push_back(part);
-            }
+    BenchRun run;
+    run.transport = transport;
+    for (const auto& s : stats) {
+        run.total.latency_us.merge(s.latency_us);
+        run.total.approved += s.approved;
+        run.total.declined += s.declined;
+    }
+    run.errors = errors.load();
+    run.throughput = run.total.latency_us.count() / elapsed_s;
+    return run;
+}
 
-            std::cout << "Parsed " << parts.size() << " parts" << std::endl;
-            
-            if (parts.size() != 4 || parts[0] != "AUTH") {
-                std::cout << "Invalid AUTH format - expected 4 parts, got " << parts.size() << std::endl;
-                return "DECLINED|Invalid AUTH format";
-            }
+void printBenchRun(const BenchOptions& options, const BenchRun& run) {
+    const LatencyHistogram& h = run.total.latency_us;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "Benchmark (" << run.transport << ", " << (options.binary ? "binary" : "text") << "): " << (options.open_loop ? "open" : "closed") << " loop, "
+              << options.connections << " connection(s), " << options.duration_s << " s";
+    if (options.open_loop) {
+        std::cout << ", target " << options.rate << " req/s";
+    }
+    std::cout << ", approve ratio " << options.approve_ratio << std::endl;
+    std::cout << "  requests:   " << h.count() << " (" << run.total.approved << " approved, " << run.total.declined
+              << " declined, " << run.errors << " errors)" << std::endl;
+    std::cout << "  throughput: " << run.throughput << " req/s" << std::endl;
+    std::cout << "  latency (ms):" << std::endl;
+    const std::pair<double, const char*> percentiles[] = {
+        {50.0, "p50"}, {75.0, "p75"}, {90.0, "p90"}, {99.0, "p99"}, {99.9, "p99.9"}, {99.99, "p99.99"}};
+    std::cout << std::setprecision(3);
+    for (const auto& p : percentiles) {
+        std::cout << "    " << std::left << std::setw(8) << p.second << std::right << std::setw(10)
+                  << h.percentile(p.first) / 1000.0 << std::endl;
+    }
+    std::cout << "    max     " << std::setw(10) << h.max() / 1000.0 << std::endl;
+    std::cout << "    mean    " << std::setw(10) << h.mean() / 1000.0 << std::endl;
+}
 
-            std::cout << "Parts: [" << parts[0] << "] [" << parts[1] << "] [" << parts[2] << "] [" << parts[3] << "]" << std::endl;
+// Prints how the second run (Unix socket) compares with the first (TCP).
+void printBenchComparison(const BenchRun& tcp, const BenchRun& uds) {
+    auto change = [](double from, double to) {
+        return from > 0 ? (to - from) / from * 100.0 : 0.0;
+    };
+    const LatencyHistogram& a = tcp.total.latency_us;
+    const LatencyHistogram& b = uds.total.latency_us;
+    std::cout << std::fixed << std::setprecision(1);
+    std::cout << "Unix socket vs TCP loopback:" << std::endl;
+    std::cout << "  p50 " << std::showpos << change(a.percentile(50), b.percentile(50)) << "%, p99 "
+              << change(a.percentile(99), b.percentile(99)) << "%, mean " << change(a.mean(), b.mean())
+              << "%, throughput " << change(tcp.throughput, uds.throughput) << "%" << std::noshowpos << std::endl;
+}
 
-            double amount;
-            long unix_ts;
-            try {
-                amount = std::stod(parts[1]);
-                unix_ts = std::stol(parts[2]);
-            } catch (const std::exception& e) {
-                std::cout << "Failed to parse amount or timestamp: " << e.what() << std::endl;
-                return "DECLINED|Invalid amount or timestamp format";
-            }
-            
-            std::string nonce = parts[3];
+int runBench(int argc, char* argv[]) {
+    BenchOptions options;
+
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for option: " << argv[i] << std::endl;
+            return 1;
+        }
 
-            std::cout << "Parsed values: amount=" << amount << ", unix_ts=" << unix_ts << ", nonce=" << nonce << std::endl;
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
 
-            if (nonce.length() < 8 || nonce.length() > 16) {
-                std::cout << "Invalid nonce length: " << nonce.length() << std::endl;
-                return "DECLINED|Invalid nonce length";
+        if (option == "--host") {
+            options.host = value;
+        } else if (option == "--port") {
+            options.port = std::stoi(value);
+        } else if (option == "--unix") {
+            options.unix_path = value;
+        } else if (option == "--protocol") {
+            if (value != "text" && value != "binary") {
+                std::cerr << "Protocol must be text or binary" << std::endl;
+                return 1;
             }
-            for (char c : nonce) {
-                if (!std::isxdigit(c)) {
-                    std::cout << "Invalid nonce character: " << c << std::endl;
-                    return "DECLINED|Invalid nonce format";
-                }
+            options.binary = value == "binary";
+        } else if (option == "--mode") {
+            if (value != "closed" && value != "open") {
+                std::cerr << "Mode must be closed or open" << std::endl;
+                return 1;
             }
-
-            bool approved = amount < 50.5;
-            std::cout << "Transaction approved: " << (approved ? "true" : "false") << std::endl;
-            
-            std::string response;
-            if (approved) {
-                std::string auth_code = generateAuthCode();
-                std::string masked_pan = generateMaskedPAN();
-                std::string rrn = generateRRN();
-                
-                std::cout << "Generated: auth_code=" << auth_code << ", masked_pan=" << masked_pan << ", rrn=" << rrn << std::endl;
-                
-                std::cout << "Storing approved transaction..." << std::endl;
-                if (!db.insertTransaction(amount, approved, auth_code, masked_pan, rrn, unix_ts, nonce)) {
-                    std::cout << "Database insert failed" << std::endl;
-                    return "DECLINED|Database error";
-                }
-                
-                std::ostringstream oss;
-                oss << "APPROVED|" << auth_code << "|" << masked_pan << "|" << rrn;
-                response = oss.str();
-            } else {
-                std::cout << "Storing declined transaction..." << std::endl;
-                if (!db.insertTransaction(amount, approved, "", "", "", unix_ts, nonce)) {
-                    std::cout << "Database insert failed for declined transaction" << std::endl;
-                }
-                
-                std::ostringstream oss;
-                oss << "DECLINED|Amount $" << std::fixed << std::setprecision(2) 
-                    << amount << " exceeds limit ($50.50)";
-                response = oss.str();
+            options.open_loop = value == "open";
+        } else if (option == "--connections") {
+            options.connections = std::stoi(value);
+            if (options.connections <= 0) {
+                std::cerr << "Number of connections must be positive" << std::endl;
+                return 1;
             }
-
-            std::cout << "Generated response: " << response << std::endl;
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            
-            return response;
-            
-        } catch (const std::exception& e) {
-            std::cout << "Exception in processAuthRequest: " << e.what() << std::endl;
-            return std::string("DECLINED|Processing error: ") + e.what();
+        } else if (option == "--rate") {
+            options.rate = std::stod(value);
+        } else if (option == "--duration") {
+            options.duration_s = std::stoi(value);
+            if (options.duration_s <= 0) {
+                std::cerr << "Duration must be positive" << std::endl;
+                return 1;
+            }
+        } else if (option == "--approve-ratio") {
+            options.approve_ratio = std::stod(value);
+            if (options.approve_ratio < 0.0 || options.approve_ratio > 1.0) {
+                std::cerr << "Approve ratio must be between 0 and 1" << std::endl;
+                return 1;
+            }
+        } else if (option == "--csv") {
+            options.csv_path = value;
+        } else if (option == "--json") {
+            options.json_path = value;
+        } else {
+            std::cerr << "Unknown option for bench command: " << option << std::endl;
+            return 1;
         }
     }
-};
 
-class POSGatewayClient {
-private:
-    std::string host;
-    int port;
+    bool tcp = !options.host.empty() && options.port != 0;
+    if (!tcp && options.unix_path.empty()) {
+        std::cerr << "Host and port, or a Unix socket path, are required for bench command" << std::endl;
+        return 1;
+    }
+    if (options.open_loop && options.rate <= 0.0) {
+        std::cerr << "Open-loop mode requires a positive --rate" << std::endl;
+        return 1;
+    }
 
-    int createConnectedSocket(int timeout_ms = 2000) {
-        int client_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (client_socket == -1) {
-            return -1;
+    // With both endpoints given, the same load runs over TCP and then over
+    // the Unix socket.
+    std::vector<BenchRun> runs;
+    if (tcp) {
+        POSGatewayClient client(options.host, options.port);
+        client.setVerbose(false);
+        client.setBinaryFraming(options.binary);
+        runs.push_back(runBenchPass(client, options, "tcp"));
+        printBenchRun(options, runs.back());
+    }
+    if (!options.unix_path.empty()) {
+        POSGatewayClient client(options.unix_path);
+        client.setVerbose(false);
+        client.setBinaryFraming(options.binary);
+        runs.push_back(runBenchPass(client, options, "unix"));
+        printBenchRun(options, runs.back());
+    }
+    if (runs.size() == 2) {
+        printBenchComparison(runs[0], runs[1]);
+    }
+
+    uint64_t errors = 0;
+    for (const auto& run : runs) {
+        errors += run.errors;
+        if (!options.csv_path.empty() && !appendBenchCsv(options.csv_path, options, run)) {
+            std::cerr << "Failed to write " << options.csv_path << std::endl;
+            return 1;
         }
+    }
+    if (!options.json_path.empty() && !writeBenchJson(options.json_path, options, runs)) {
+        std::cerr << "Failed to write " << options.json_path << std::endl;
+        return 1;
+    }
+    return errors == 0 ? 0 : 1;
+}
 
-        setSocketTimeout(client_socket, timeout_ms);
+const char* traceSpanName(uint8_t phase) {
+    switch (static_cast<TracePhase>(phase)) {
+        case TracePhase::HandshakeComplete:
+            return "handshake";
+        case TracePhase::Parsed:
+            return "parse";
+        case TracePhase::Decided:
+            return "decide";
+        case TracePhase::Enqueued:
+            return "enqueue";
+        case TracePhase::Committed:
+            return "commit";
+        case TracePhase::ReplySent:
+            return "reply";
+        case TracePhase::Accept:
+        case TracePhase::LineFramed:
+            break;
+    }
+    return "wait";
+}
 
-        sockaddr_in server_addr{};
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(port);
-        
-        if (inet_pton(AF_INET, host.c_str(), &server_addr.sin_addr) <= 0) {
-            close(client_socket);
-            return -1;
-        }
+// Searches the stored transactions; see TransactionQuery for the filters.
+int runQuery(int argc, char* argv[]) {
+    TransactionQuery query;
+    QueryFormat format = QueryFormat::Table;
+    std::string out_path;
 
-        if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            close(client_socket);
-            return -1;
+    auto parseInt = [](const std::string& value, int64_t& result) {
+        auto parsed = std::from_chars(value.data(), value.data() + value.size(), result);
+        return parsed.ec == std::errc() && parsed.ptr == value.data() + value.size();
+    };
+
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for option: " << argv[i] << std::endl;
+            return 1;
         }
 
-        return client_socket;
-    }
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
 
-    std::string readLine(int socket) {
-        std::string line;
-        char c;
-        while (recv(socket, &c, 1, 0) == 1) {
-            if (c == '\n') {
-                break;
+        if (option == "--from" || option == "--to") {
+            if (!parseInt(value, option == "--from" ? query.from_ts : query.to_ts)) {
+                std::cerr << "Invalid timestamp for " << option << ": " << value << std::endl;
+                return 1;
+            }
+        } else if (option == "--status") {
+            if (value != "approved" && value != "declined") {
+                std::cerr << "Status must be approved or declined" << std::endl;
+                return 1;
+            }
+            query.approved = value == "approved" ? 1 : 0;
+        } else if (option == "--rrn") {
+            query.rrn = value;
+        } else if (option == "--auth-code") {
+            query.auth_code = value;
+        } else if (option == "--limit") {
+            if (!parseInt(value, query.limit) || query.limit <= 0) {
+                std::cerr << "Limit must be positive" << std::endl;
+                return 1;
+            }
+        } else if (option == "--after") {
+            if (!parseQueryCursor(value, query)) {
+                std::cerr << "Invalid cursor: " << value << std::endl;
+                return 1;
+            }
+        } else if (option == "--order") {
+            if (value != "newest" && value != "oldest") {
+                std::cerr << "Order must be newest or oldest" << std::endl;
+                return 1;
             }
-            if (c != '\r') { 
-                line += c;
+            query.ascending = value == "oldest";
+        } else if (option == "--format") {
+            if (value == "table") {
+                format = QueryFormat::Table;
+            } else if (value == "csv") {
+                format = QueryFormat::Csv;
+            } else if (value == "json") {
+                format = QueryFormat::Json;
+            } else {
+                std::cerr << "Format must be table, csv or json" << std::endl;
+                return 1;
             }
+        } else if (option == "--out") {
+            out_path = value;
+        } else {
+            std::cerr << "Unknown option for query command: " << option << std::endl;
+            return 1;
         }
-        return line;
     }
 
-    bool sendLine(int socket, const std::string& line) {
-        std::string message = line + "\n";
-        return send(socket, message.c_str(), message.length(), 0) >= 0;
-    }
+    // Info logs go to stdout and would end up inside CSV or JSON output.
+    Logger::instance().setLevel(LogLevel::Warn);
 
-    bool performHandshake(int socket) {
-        if (!sendLine(socket, "HELLO|GW|1.0")) {
-            return false;
+    int fd = STDOUT_FILENO;
+    if (!out_path.empty()) {
+        fd = open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            std::cerr << "Failed to create " << out_path << ": " << strerror(errno) << std::endl;
+            return 1;
         }
-        std::cout << "Sent: HELLO|GW|1.0" << std::endl;
-
-        std::string response = readLine(socket);
-        response = stripCR(response);
-        std::cout << "Received: " << response << std::endl;
-
-        return response == "HELLO|TERM|1.0";
     }
+    bool ok;
+    {
+        BufferedWriter out(fd);
+        ok = streamTransactions(transactionDatabasePaths(), query, out, format, "Transactions:");
+    }
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+    return ok ? 0 : 1;
+}
 
-public:
-    POSGatewayClient(const std::string& host, int port) : host(host), port(port) {}
+// Converts a --trace file into Chrome trace JSON (chrome://tracing,
+// Perfetto). Each worker is a process and each connection a thread; every
+// step of a request becomes a span ending at the phase it is named after.
+int runTraceDump(int argc, char* argv[]) {
+    std::string in_path;
+    std::string out_path;
 
-    bool sendSaleRequest(double amount) {
-        int retries = 0;
-        const int max_retries = 2;
-        
-        while (retries <= max_retries) {
-            int client_socket = createConnectedSocket();
-            if (client_socket == -1) {
-                std::cerr << "Connection failed to " << host << ":" << port;
-                if (retries < max_retries) {
-                    int delay_ms = 200 * (1 << retries); 
-                    std::cerr << ", retrying in " << delay_ms << "ms..." << std::endl;
-                    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
-                    retries++;
-                    continue;
-                } else {
-                    std::cerr << ", giving up after " << max_retries << " retries" << std::endl;
-                    return false;
-                }
-            }
+    for (int i = 2; i < argc; i += 2) {
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for option: " << argv[i] << std::endl;
+            return 1;
+        }
 
-            setSocketTimeout(client_socket, 3000); 
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
 
-            bool success = false;
-            try {
-                if (!performHandshake(client_socket)) {
-                    std::cerr << "Handshake failed" << std::endl;
-                    close(client_socket);
-                    
-                    if (retries == 0) {
-                        std::cout << "Server dropped connection after HELLO, retrying..." << std::endl;
-                        retries++;
-                        continue;
-                    } else {
-                        return false;
-                    }
-                }
+        if (option == "--file") {
+            in_path = value;
+        } else if (option == "--out") {
+            out_path = value;
+        } else {
+            std::cerr << "Unknown option for trace-dump command: " << option << std::endl;
+            return 1;
+        }
+    }
 
-                long unix_ts = getCurrentUnixTimestamp();
-                std::string nonce = generateNonce();
+    if (in_path.empty()) {
+        std::cerr << "Trace file is required for trace-dump command" << std::endl;
+        return 1;
+    }
 
-                std::ostringstream auth_request;
-                auth_request << "AUTH|" << std::fixed << std::setprecision(2) 
-                           << amount << "|" << unix_ts << "|" << nonce;
-                
-                if (!sendLine(client_socket, auth_request.str())) {
-                    std::cerr << "Failed to send AUTH request" << std::endl;
-                    close(client_socket);
-                    return false;
-                }
+    std::ifstream in(in_path, std::ios::binary);
+    char magic[sizeof(Tracer::kMagic)];
+    if (!in.read(magic, sizeof(magic)) || memcmp(magic, Tracer::kMagic, sizeof(magic)) != 0) {
+        std::cerr << "Not a trace file: " << in_path << std::endl;
+        return 1;
+    }
 
-                std::cout << "Sent: " << auth_request.str() << std::endl;
+    std::vector<TraceRecord> records;
+    TraceRecord rec;
+    while (in.read(reinterpret_cast<char*>(&rec), sizeof(rec))) {
+        records.push_back(rec);
+    }
+    if (records.empty()) {
+        std::cerr << "Trace file has no records" << std::endl;
+        return 1;
+    }
 
-                auto start_time = std::chrono::steady_clock::now();
-                std::string response;
-                
-                while (true) {
-                    auto current_time = std::chrono::steady_clock::now();
-                    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-                        current_time - start_time).count();
-                    
-                    if (elapsed >= 3000) { 
-                        if (!sendLine(client_socket, "PING")) {
-                            std::cerr << "Failed to send PING" << std::endl;
-                            break;
-                        }
-                        std::cout << "Sent: PING" << std::endl;
-                        start_time = current_time;
-                    }
+    std::sort(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        if (a.conn_id != b.conn_id) {
+            return a.conn_id < b.conn_id;
+        }
+        if (a.seq != b.seq) {
+            return a.seq < b.seq;
+        }
+        return a.ts_ns < b.ts_ns;
+    });
+    uint64_t base_ns = std::min_element(records.begin(), records.end(), [](const TraceRecord& a, const TraceRecord& b) {
+        return a.ts_ns < b.ts_ns;
+    })->ts_ns;
 
-                    response = readLine(client_socket);
-                    response = stripCR(response);
-                    
-                    if (!response.empty()) {
-                        if (response == "PONG") {
-                            std::cout << "Received: PONG" << std::endl;
-                            start_time = std::chrono::steady_clock::now();
-                            continue;
-                        } else {
-                            std::cout << "Payment gateway response: " << response << std::endl;
-                            success = true;
-                            break;
-                        }
-                    }
-                    
-                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-                }
+    std::ofstream file;
+    if (!out_path.empty()) {
+        file.open(out_path);
+        if (!file) {
+            std::cerr << "Failed to open " << out_path << std::endl;
+            return 1;
+        }
+    }
+    std::ostream& out = out_path.empty() ? std::cout : file;
 
-            } catch (const std::exception& e) {
-                std::cerr << "Exception during transaction: " << e.what() << std::endl;
-            }
+    bool first = true;
+    auto emit = [&](const char* name, const TraceRecord& from, const TraceRecord& to) {
+        out << (first ? "\n" : ",\n") << "{\"name\":\"" << name << "\",\"ph\":\"X\",\"ts\":"
+            << (from.ts_ns - base_ns) / 1000.0 << ",\"dur\":" << (to.ts_ns - from.ts_ns) / 1000.0
+            << ",\"pid\":" << (to.conn_id >> 48) << ",\"tid\":" << (to.conn_id & 0xFFFFFFFFFFFFull)
+            << ",\"args\":{\"seq\":" << (to.seq == Tracer::kNoSeq ? -1 : static_cast<int64_t>(to.seq))
+            << ",\"thread\":" << to.thread << "}}";
+        first = false;
+    };
 
-            close(client_socket);
-            
-            if (success) {
-                return true;
-            }
-            
-            if (retries < max_retries) {
-                int delay_ms = 200 * (1 << retries); 
-                std::cout << "Transaction failed, retrying in " << delay_ms << "ms..." << std::endl;
-                std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
-                retries++;
-            } else {
-                std::cerr << "Transaction failed after " << max_retries << " retries" << std::endl;
-                return false;
-            }
+    out << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+    size_t spans = 0;
+    for (size_t start = 0; start < records.size();) {
+        size_t end = start + 1;
+        while (end < records.size() && records[end].conn_id == records[start].conn_id &&
+               records[end].seq == records[start].seq) {
+            end++;
         }
-        
-        return false;
+        if (records[start].seq != Tracer::kNoSeq && end - start > 1) {
+            emit("AUTH", records[start], records[end - 1]);
+            spans++;
+        }
+        for (size_t i = start + 1; i < end; i++) {
+            emit(traceSpanName(records[i].phase), records[i - 1], records[i]);
+            spans++;
+        }
+        start = end;
     }
-};
+    out << "\n]}\n";
+
+    std::cerr << "Converted " << records.size() << " record(s) into " << spans << " span(s)" << std::endl;
+    return 0;
+}
 
 void printUsage(const char* program_name) {
     std::cout << "Usage: " << program_name << " <command> [options]" << std::endl;
     std::cout << "Commands:" << std::endl;
     std::cout << "  server --port <port>                    Start payment gateway terminal" << std::endl;
+    std::cout << "         [--workers <n>] [--pin-cpus <auto|cpu,cpu,...>]" << std::endl;
+    std::cout << "         [--durability <commit|enqueue>] [--batch-size <n>] [--flush-interval-ms <ms>]" << std::endl;
+    std::cout << "         [--log-level <error|warn|info|debug>]" << std::endl;
+    std::cout << "         [--latency <fixed:ms|uniform:min_ms:max_ms|lognormal:median_ms:sigma>]" << std::endl;
+    std::cout << "         [--replay-window <sec>] [--replay-capacity <n>] [--metrics-port <port>]" << std::endl;
+    std::cout << "         [--trace <file>] [--rules <file>]" << std::endl;
+    std::cout << "         [--backlog <n>] [--source-rate <req/s>] [--source-burst <n>]" << std::endl;
+    std::cout << "         [--busy-backlog <n>] [--max-pending <n>] [--storage <single|sharded>]" << std::endl;
+    std::cout << "         [--journal <dir>] [--journal-sync <batch|periodic:ms>] [--journal-segment-records <n>]" << std::endl;
+    std::cout << "         [--io <epoll|uring>] [--unix <path>]" << std::endl;
     std::cout << "  sale --amount <amount> --host <host> --port <port>  Send sale request" << std::endl;
-    std::cout << "  last --n <count>                        Show last N transactions from database" << std::endl;
+    std::cout << "       [--unix <path>] (instead of --host/--port)" << std::endl;
+    std::cout << "       [--count <n>] [--pipeline <depth>] [--protocol <text|binary>]" << std::endl;
+    std::cout << "  sale --file <sales> --host <host> --port <port>  Send every sale in a file" << std::endl;
+    std::cout << "       [--concurrency <sessions>] [--pipeline <depth per session>] [--out <results.csv>]" << std::endl;
+    std::cout << "  bench --host <host> --port <port>       Measure throughput and latency" << std::endl;
+    std::cout << "        [--unix <path>] (with --host/--port too: compare TCP and Unix socket)" << std::endl;
+    std::cout << "        [--protocol <text|binary>] [--mode <closed|open>] [--connections <n>] [--rate <req/s>] [--duration <sec>]" << std::endl;
+    std::cout << "        [--approve-ratio <0..1>] [--csv <file>] [--json <file>]" << std::endl;
+    std::cout << "  last --n <count>                        Show last N transactions from all database files" << std::endl;
+    std::cout << "  query [--from <unix_ts>] [--to <unix_ts>] [--status <approved|declined>]  Search transactions" << std::endl;
+    std::cout << "        [--rrn <rrn>] [--auth-code <code>] [--order <newest|oldest>] [--limit <n>] [--after <cursor>]" << std::endl;
+    std::cout << "        [--format <table|csv|json>] [--out <file>]" << std::endl;
+    std::cout << "  trace-dump --file <trace> [--out <json>]  Convert a server trace to Chrome trace JSON" << std::endl;
+    std::cout << "  microbench <parse|ids|replay> [--iterations <n>] [--threads <n>]  Run an in-process microbenchmark" << std::endl;
     std::cout << std::endl;
     std::cout << "Examples:" << std::endl;
     std::cout << "  " << program_name << " server --port 9000" << std::endl;
+    std::cout << "  " << program_name << " server --port 9000 --workers 4 --pin-cpus auto" << std::endl;
     std::cout << "  " << program_name << " sale --amount 12.34 --host 127.0.0.1 --port 9000" << std::endl;
+    std::cout << "  " << program_name << " bench --host 127.0.0.1 --port 9000 --mode open --rate 500" << std::endl;
     std::cout << "  " << program_name << " last --n 5" << std::endl;
 }
 
@@ -664,7 +7369,7 @@ int main(int argc, char* argv[]) {
     std::string command = argv[1];
 
     if (command == "server") {
-        int port = 0;
+        ServerConfig config;
         
         for (int i = 2; i < argc; i += 2) {
             if (i + 1 >= argc) {
@@ -676,28 +7381,178 @@ int main(int argc, char* argv[]) {
             std::string value = argv[i + 1];
             
             if (option == "--port") {
-                port = std::stoi(value);
+                config.port = std::stoi(value);
+            } else if (option == "--workers") {
+                config.workers = std::stoi(value);
+                if (config.workers <= 0) {
+                    std::cerr << "Number of workers must be positive" << std::endl;
+                    return 1;
+                }
+                if (config.workers > static_cast<int>(IdGenerator::kRrnSlots)) {
+                    std::cerr << "At most " << IdGenerator::kRrnSlots << " workers are supported" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--pin-cpus") {
+                if (!parseCpuList(value, config.cpus)) {
+                    std::cerr << "Invalid CPU list: " << value << std::endl;
+                    return 1;
+                }
+            } else if (option == "--log-level") {
+                LogLevel level;
+                if (!parseLogLevel(value, level)) {
+                    std::cerr << "Log level must be error, warn, info or debug" << std::endl;
+                    return 1;
+                }
+                Logger::instance().setLevel(level);
+            } else if (option == "--latency") {
+                if (!config.latency.parse(value)) {
+                    std::cerr << "Invalid latency model: " << value << std::endl;
+                    return 1;
+                }
+            } else if (option == "--replay-window") {
+                config.replay_window = std::stol(value);
+                if (config.replay_window < 0) {
+                    std::cerr << "Replay window must not be negative" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--replay-capacity") {
+                long capacity = std::stol(value);
+                if (capacity <= 0) {
+                    std::cerr << "Replay capacity must be positive" << std::endl;
+                    return 1;
+                }
+                config.replay_capacity = capacity;
+            } else if (option == "--backlog") {
+                config.backlog = std::stoi(value);
+                if (config.backlog <= 0) {
+                    std::cerr << "Backlog must be positive" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--source-rate") {
+                config.source_rate = std::stod(value);
+                if (config.source_rate < 0) {
+                    std::cerr << "Source rate must not be negative" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--source-burst") {
+                config.source_burst = std::stod(value);
+                if (config.source_burst < 1) {
+                    std::cerr << "Source burst must be at least 1" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--busy-backlog") {
+                long backlog = std::stol(value);
+                if (backlog <= 0) {
+                    std::cerr << "Busy backlog must be positive" << std::endl;
+                    return 1;
+                }
+                config.busy_backlog = backlog;
+            } else if (option == "--max-pending") {
+                long pending = std::stol(value);
+                if (pending <= 0) {
+                    std::cerr << "Max pending must be positive" << std::endl;
+                    return 1;
+                }
+                config.max_pending = pending;
+            } else if (option == "--rules") {
+                config.rules_path = value;
+            } else if (option == "--trace") {
+                config.trace_path = value;
+            } else if (option == "--metrics-port") {
+                config.metrics_port = std::stoi(value);
+                if (config.metrics_port <= 0 || config.metrics_port > 65535) {
+                    std::cerr << "Metrics port must be between 1 and 65535" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--unix") {
+                config.unix_path = value;
+            } else if (option == "--io") {
+                if (value == "epoll") {
+                    config.io_backend = IoBackend::Epoll;
+                } else if (value == "uring") {
+                    config.io_backend = IoBackend::Uring;
+                } else {
+                    std::cerr << "I/O backend must be 'epoll' or 'uring'" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--journal") {
+                config.journal_dir = value;
+            } else if (option == "--journal-sync") {
+                if (value == "batch") {
+                    config.journal_sync = TransactionJournal::Sync::Batch;
+                } else if (value.rfind("periodic:", 0) == 0 && std::stoi(value.substr(9)) > 0) {
+                    config.journal_sync = TransactionJournal::Sync::Periodic;
+                    config.journal_sync_interval_ms = std::stoi(value.substr(9));
+                } else {
+                    std::cerr << "Journal sync must be 'batch' or 'periodic:<ms>'" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--journal-segment-records") {
+                long records = std::stol(value);
+                if (records <= 0) {
+                    std::cerr << "Journal segment records must be positive" << std::endl;
+                    return 1;
+                }
+                config.journal_segment_records = records;
+            } else if (option == "--storage") {
+                if (value == "single") {
+                    config.sharded_storage = false;
+                } else if (value == "sharded") {
+                    config.sharded_storage = true;
+                } else {
+                    std::cerr << "Storage must be 'single' or 'sharded'" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--durability") {
+                if (value == "commit") {
+                    config.durability = Durability::Commit;
+                } else if (value == "enqueue") {
+                    config.durability = Durability::Enqueue;
+                } else {
+                    std::cerr << "Durability must be 'commit' or 'enqueue'" << std::endl;
+                    return 1;
+                }
+            } else if (option == "--batch-size") {
+                int batch_size = std::stoi(value);
+                if (batch_size <= 0) {
+                    std::cerr << "Batch size must be positive" << std::endl;
+                    return 1;
+                }
+                config.batch_size = batch_size;
+            } else if (option == "--flush-interval-ms") {
+                config.flush_interval_ms = std::stoi(value);
+                if (config.flush_interval_ms < 0) {
+                    std::cerr << "Flush interval must not be negative" << std::endl;
+                    return 1;
+                }
             } else {
                 std::cerr << "Unknown option: " << option << std::endl;
                 return 1;
             }
         }
         
-        if (port == 0) {
-            std::cerr << "Port is required for server mode" << std::endl;
+        if (config.port == 0 && config.unix_path.empty()) {
+            std::cerr << "Port or Unix socket path is required for server mode" << std::endl;
             printUsage(argv[0]);
             return 1;
         }
-        PaymentGatewayServer server(port);
+        PaymentGatewayServer server(config);
         if (!server.start()) {
             return 1;
         }
         server.run();
         
     } else if (command == "sale") {
-        double amount = 0.0;
+        Money amount = Money::fromMinor(0);
         std::string host;
         int port = 0;
+        std::string unix_path;
+        int count = 1;
+        int pipeline = 0;
+        bool binary = false;
+        std::string file_path;
+        std::string out_path;
+        int concurrency = 4;
         
         for (int i = 2; i < argc; i += 2) {
             if (i + 1 >= argc) {
@@ -709,28 +7564,89 @@ int main(int argc, char* argv[]) {
             std::string value = argv[i + 1];
             
             if (option == "--amount") {
-                amount = std::stod(value);
+                if (!Money::parse(value, amount)) {
+                    std::cerr << "Invalid amount: " << value << std::endl;
+                    return 1;
+                }
             } else if (option == "--host") {
                 host = value;
             } else if (option == "--port") {
                 port = std::stoi(value);
+            } else if (option == "--unix") {
+                unix_path = value;
+            } else if (option == "--count") {
+                count = std::stoi(value);
+            } else if (option == "--pipeline") {
+                pipeline = std::stoi(value);
+            } else if (option == "--protocol") {
+                if (value != "text" && value != "binary") {
+                    std::cerr << "Protocol must be text or binary" << std::endl;
+                    return 1;
+                }
+                binary = value == "binary";
+            } else if (option == "--file") {
+                file_path = value;
+            } else if (option == "--out") {
+                out_path = value;
+            } else if (option == "--concurrency") {
+                concurrency = std::stoi(value);
+                if (concurrency <= 0) {
+                    std::cerr << "Concurrency must be positive" << std::endl;
+                    return 1;
+                }
             } else {
                 std::cerr << "Unknown option: " << option << std::endl;
                 return 1;
             }
         }
         
-        if (amount <= 0.0 || host.empty() || port == 0) {
-            std::cerr << "Amount, host, and port are required for sale command" << std::endl;
-            printUsage(argv[0]);
+        if (count < 1) {
+            std::cerr << "Count must be at least 1" << std::endl;
+            return 1;
+        }
+        
+        if (pipeline < 0) {
+            std::cerr << "Pipeline depth must not be negative" << std::endl;
             return 1;
         }
         
-        POSGatewayClient client(host, port);
-        if (!client.sendSaleRequest(amount)) {
+        if ((amount.minor <= 0 && file_path.empty()) || (unix_path.empty() && (host.empty() || port == 0))) {
+            std::cerr << "Amount (or --file) and either host and port or a Unix socket path are required for sale command" << std::endl;
+            printUsage(argv[0]);
             return 1;
         }
         
+        POSGatewayClient client = unix_path.empty() ? POSGatewayClient(host, port) : POSGatewayClient(unix_path);
+        if (!file_path.empty()) {
+            client.setVerbose(false);
+            client.setBinaryFraming(binary);
+            if (out_path.empty()) {
+                out_path = file_path + ".results.csv";
+            }
+            return client.sendSalesFromFile(file_path, out_path, concurrency, pipeline > 0 ? pipeline : 16) ? 0 : 1;
+        }
+        // The binary framing is only spoken on pipelined sessions.
+        if (binary) {
+            client.setBinaryFraming(true);
+            pipeline = std::max(pipeline, 1);
+        }
+        if (pipeline > 0) {
+            return client.sendPipelinedSales(amount, count, pipeline) ? 0 : 1;
+        }
+        for (int n = 0; n < count; n++) {
+            if (!client.sendSaleRequest(amount)) {
+                return 1;
+            }
+        }
+        
+    } else if (command == "trace-dump") {
+        return runTraceDump(argc, argv);
+    } else if (command == "query") {
+        return runQuery(argc, argv);
+    } else if (command == "bench") {
+        return runBench(argc, argv);
+    } else if (command == "microbench") {
+        return runMicrobench(argc, argv);
     } else if (command == "last"){
         int n = 10;
         
@@ -755,15 +7671,9 @@ int main(int argc, char* argv[]) {
             }
         }
         
-        TransactionDB db;
-        if (!db.init()){
-            std::cerr << "Failed to initialize database" << std::endl;
+        if (!showLastTransactions(n)) {
             return 1;
         }
-        
-        if (!db.getLastTransactions(n)){
-            return 1;
-        }        
     } else {
         std::cerr << "Unknown command: " << command << std::endl;
         printUsage(argv[0]);